@@ -0,0 +1,328 @@
+#!/usr/bin/env python3
+"""Compile time and peak memory of the visit template machinery.
+
+Generates one translation unit per (target, arity, alternatives) and
+compiles it, one line of CSV per compilation:
+
+  target,arity,alternatives,entries,status,seconds,peak_rss_kb
+
+Targets:
+  visit      tools::visit from visit.h
+  v2_types   v2::tools::make_type_list from visit2.h, entries long
+  v2_array   v2::tools::make_array from visit2.h, entries long
+  v3_visit   v3::visit from visit3.h
+  get        tools::get<i> for every i of an entries long type_list
+  v2_get     v2::tools::get<i> for every i of an entries long type_list
+
+--time-trace (clang only) also writes the templates that took the most
+time per case to <output>.templates.csv.
+
+--baseline old.csv reports every case that got slower or bigger than
+--threshold times the baseline and exits with 1, so header changes can be
+checked against a saved run:
+
+  ./compile_time_benchmark.py -o before.csv
+  <change the headers>
+  ./compile_time_benchmark.py -o after.csv --baseline before.csv
+"""
+
+import argparse
+import collections
+import csv
+import json
+import os
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+
+COMMON = """
+#include <cstddef>
+#include <utility>
+#include <variant>
+
+template <std::size_t i>
+struct alt {{
+  int value;
+}};
+
+template <std::size_t... idxs>
+auto make_variant(std::index_sequence<idxs...>) -> std::variant<alt<idxs>...>;
+
+using V = decltype(make_variant(std::make_index_sequence<{alternatives}>{{}}));
+
+struct op {{
+  template <typename... Ts>
+  int operator()(const Ts&...) const {{
+    return sizeof...(Ts);
+  }}
+}};
+"""
+
+VISIT = """
+#include "visit.h"
+{common}
+int run({params}) {{
+  return tools::visit(op{{}}, {args});
+}}
+"""
+
+V3_VISIT = """
+{common}
+#include "visit3.h"
+
+int run({params}) {{
+  return v3::visit(op{{}}, {args});
+}}
+"""
+
+V2_TYPES = """
+#include "visit2.h"
+
+template <std::size_t i>
+struct alt {{}};
+
+constexpr auto types = v2::tools::make_type_list<{entries}>([](auto i) {{
+  return v2::tools::type_<alt<decltype(i)::value>>{{}};
+}});
+
+static_assert(types.size() == {entries});
+"""
+
+V2_ARRAY = """
+#include "visit2.h"
+
+template <std::size_t i>
+struct value_of {{
+  using type = std::size_t;
+  constexpr operator std::size_t() const {{ return i; }}
+}};
+
+constexpr auto array = v2::tools::make_array<{entries}>([](auto i) {{
+  return value_of<decltype(i)::value>{{}};
+}});
+
+static_assert(array.size() == {entries});
+"""
+
+GET = """
+#include "visit.h"
+
+template <std::size_t i>
+struct alt {{}};
+
+template <std::size_t... is>
+constexpr bool get_all(std::index_sequence<is...>) {{
+  using list = tools::type_list<alt<is>...>;
+  return tools::all_true({{std::is_same_v<
+      typename decltype(tools::get<is>(list{{}}))::type, alt<is>>...}});
+}}
+
+static_assert(get_all(std::make_index_sequence<{entries}>{{}}));
+"""
+
+V2_GET = """
+#include "visit2.h"
+
+template <std::size_t i>
+struct alt {{}};
+
+template <std::size_t... is>
+constexpr bool get_all(std::index_sequence<is...>) {{
+  using list = v2::tools::type_list<alt<is>...>;
+  const bool same[] = {{std::is_same_v<
+      typename decltype(v2::tools::get<is>(list{{}}))::type, alt<is>>...}};
+  for (bool x : same) {{
+    if (!x) {{
+      return false;
+    }}
+  }}
+  return true;
+}}
+
+static_assert(get_all(std::make_index_sequence<{entries}>{{}}));
+"""
+
+TARGETS = {
+    "visit": VISIT,
+    "v2_types": V2_TYPES,
+    "v2_array": V2_ARRAY,
+    "v3_visit": V3_VISIT,
+    "get": GET,
+    "v2_get": V2_GET,
+}
+
+FIELDS = ["target", "arity", "alternatives", "entries", "status", "seconds",
+          "peak_rss_kb"]
+
+
+def generate(target, arity, alternatives):
+    entries = alternatives ** arity
+    common = COMMON.format(alternatives=alternatives)
+    params = ", ".join("const V& v%d" % i for i in range(arity))
+    args = ", ".join("v%d" % i for i in range(arity))
+    return TARGETS[target].format(common=common, params=params, args=args,
+                                  entries=entries)
+
+
+def compile_once(cmd, timeout):
+    """Returns (status, seconds, peak_rss_kb) of one compiler run."""
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    status = None
+    while status is None:
+        pid, exit_status, usage = os.wait4(proc.pid, os.WNOHANG)
+        if pid:
+            status = "ok" if os.waitstatus_to_exitcode(exit_status) == 0 \
+                else "error"
+        elif time.monotonic() - start > timeout:
+            proc.kill()
+            pid, exit_status, usage = os.wait4(proc.pid, 0)
+            status = "timeout"
+        else:
+            time.sleep(0.01)
+    # Already reaped by wait4.
+    proc.returncode = 0
+    seconds = time.monotonic() - start
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS.
+    rss = usage.ru_maxrss // 1024 if sys.platform == "darwin" \
+        else usage.ru_maxrss
+    return status, seconds, rss
+
+
+def top_templates(trace_path, count):
+    """Sums the clang -ftime-trace instantiation events per template."""
+    with open(trace_path) as f:
+        events = json.load(f)["traceEvents"]
+    totals = collections.Counter()
+    for e in events:
+        if e.get("name") in ("InstantiateFunction", "InstantiateClass") and \
+                "dur" in e:
+            totals[e["args"]["detail"]] += e["dur"]
+    return totals.most_common(count)
+
+
+def load_csv(path):
+    with open(path) as f:
+        return {(r["target"], r["arity"], r["alternatives"]): r
+                for r in csv.DictReader(f)}
+
+
+# Smaller differences are noise.
+MIN_DELTA = {"seconds": 0.1, "peak_rss_kb": 4096}
+
+
+def regressions(baseline, rows, threshold):
+    res = []
+    for row in rows:
+        old = baseline.get((row["target"], str(row["arity"]),
+                            str(row["alternatives"])))
+        if old is None:
+            continue
+        if old["status"] == "ok" and row["status"] != "ok":
+            res.append((row, "status %s" % row["status"]))
+            continue
+        if row["status"] != "ok" or old["status"] != "ok":
+            continue
+        for field in ("seconds", "peak_rss_kb"):
+            before, after = float(old[field]), float(row[field])
+            if after > before * threshold and \
+                    after - before > MIN_DELTA[field]:
+                res.append((row, "%s %.2f -> %.2f" % (field, before, after)))
+    return res
+
+
+def parse_list(s):
+    return [int(x) for x in s.split(",")]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "c++"))
+    parser.add_argument("--flags", default="-std=c++17 -O2",
+                        help="compiler flags, default: %(default)s")
+    parser.add_argument("--targets", default=",".join(TARGETS))
+    parser.add_argument("--alternatives", type=parse_list,
+                        default=[2, 4, 8, 16, 32, 64, 128, 256])
+    parser.add_argument("--arities", type=parse_list, default=[1, 2, 3, 4])
+    parser.add_argument("--max-entries", type=int, default=4096,
+                        help="skip cases with bigger tables")
+    parser.add_argument("--timeout", type=float, default=600)
+    parser.add_argument("--time-trace", action="store_true")
+    parser.add_argument("--top", type=int, default=10,
+                        help="templates per case for --time-trace")
+    parser.add_argument("-o", "--output", help="CSV file, default stdout")
+    parser.add_argument("--baseline", help="CSV of a previous run")
+    parser.add_argument("--threshold", type=float, default=1.2)
+    args = parser.parse_args()
+
+    targets = args.targets.split(",")
+    for target in targets:
+        if target not in TARGETS:
+            parser.error("unknown target " + target)
+
+    out = open(args.output, "w", newline="") if args.output else sys.stdout
+    writer = csv.DictWriter(out, FIELDS)
+    writer.writeheader()
+
+    trace_writer = None
+    if args.time_trace:
+        trace_out = open((args.output or "compile_time") + ".templates.csv",
+                         "w", newline="")
+        trace_writer = csv.writer(trace_out)
+        trace_writer.writerow(["target", "arity", "alternatives", "template",
+                               "ms"])
+
+    rows = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for target in targets:
+            for arity in args.arities:
+                for alternatives in args.alternatives:
+                    entries = alternatives ** arity
+                    if entries > args.max_entries:
+                        continue
+
+                    src = os.path.join(tmp, "case.cc")
+                    obj = os.path.join(tmp, "case.o")
+                    with open(src, "w") as f:
+                        f.write(generate(target, arity, alternatives))
+
+                    cmd = [args.cxx] + shlex.split(args.flags) + \
+                        ["-I", ROOT, "-c", src, "-o", obj]
+                    if args.time_trace:
+                        cmd.append("-ftime-trace")
+
+                    status, seconds, rss = compile_once(cmd, args.timeout)
+                    row = {"target": target, "arity": arity,
+                           "alternatives": alternatives, "entries": entries,
+                           "status": status, "seconds": "%.3f" % seconds,
+                           "peak_rss_kb": rss}
+                    rows.append(row)
+                    writer.writerow(row)
+                    out.flush()
+
+                    trace = os.path.join(tmp, "case.json")
+                    if trace_writer and status == "ok" and \
+                            os.path.exists(trace):
+                        for name, us in top_templates(trace, args.top):
+                            trace_writer.writerow([target, arity, alternatives,
+                                                   name, "%.3f" % (us / 1000)])
+                        os.remove(trace)
+
+    if args.baseline:
+        found = regressions(load_csv(args.baseline), rows, args.threshold)
+        for row, what in found:
+            print("regression: %s arity %s alternatives %s: %s" %
+                  (row["target"], row["arity"], row["alternatives"], what),
+                  file=sys.stderr)
+        return 1 if found else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,105 @@
+#!/bin/sh
+# Compiles a two-variant visit and inspects the object file: the dispatch
+# table has to be one weak read-only object with no dynamic initialization,
+# and the dispatch function must not build the table on every call.
+# Then checks that an extern table is not instantiated by its users, and
+# that the one instantiated in another object file is called.
+
+CXX=${CXX:-c++}
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail() {
+  echo "static_tables_test: $1"
+  exit 1
+}
+
+cat > "$tmp/tables.cc" <<'CC'
+#include "visit.h"
+
+using V = std::variant<int, char, long, short, float, double, unsigned, bool,
+                       signed char, unsigned char, long long, unsigned long>;
+
+struct sum {
+  template <typename X, typename Y>
+  int operator()(X x, Y y) const { return static_cast<int>(x + y); }
+};
+
+int dispatch(const V& a, const V& b) {
+  return tools::visit_with_r<int>(sum{}, a, b);
+}
+CC
+
+$CXX --std=c++17 -O3 -I"$dir" -c "$tmp/tables.cc" -o "$tmp/tables.o" ||
+  fail "compilation failed"
+
+nm "$tmp/tables.o" | grep -q 'GLOBAL__sub_I' && fail "dynamic initialization"
+
+objdump -t -C "$tmp/tables.o" | grep 'tools::visit_vtable<' > "$tmp/table" ||
+  fail "no table object"
+grep -Eq '\.rodata|\.data\.rel\.ro|__const' "$tmp/table" ||
+  fail "table is not in read-only data"
+
+thunks=$(objdump -dr -C "$tmp/tables.o" | awk '/<dispatch\(/,/^$/' |
+         grep -c 'visit_vtable_generator')
+[ "$thunks" -le 2 ] || fail "table is built on every call"
+
+# With TOOLS_VISIT_EXTERN_TABLE the table lives in another object file.
+# The macro is used from the header of the variant, which lives in its own
+# namespace.
+cat > "$tmp/app.h" <<'CC'
+#include "visit.h"
+
+namespace app {
+
+using V = std::variant<int, char, long, short, float, double, unsigned, bool,
+                       signed char, unsigned char, long long, unsigned long>;
+
+struct sum {
+  template <typename X, typename Y>
+  int operator()(X x, Y y) const { return static_cast<int>(x + y); }
+};
+
+int dispatch(const V& a, const V& b);
+
+}  // namespace app
+
+TOOLS_VISIT_EXTERN_TABLE(int, app::sum&&, const app::V&, const app::V&)
+CC
+
+cat > "$tmp/extern.cc" <<'CC'
+#include "app.h"
+
+namespace app {
+
+int dispatch(const V& a, const V& b) {
+  return tools::visit_with_r<int>(sum{}, a, b);
+}
+
+}  // namespace app
+CC
+
+cat > "$tmp/instantiate.cc" <<'CC'
+#include "app.h"
+
+TOOLS_VISIT_INSTANTIATE_TABLE(int, app::sum&&, const app::V&, const app::V&)
+
+int main() {
+  return app::dispatch(app::V{2}, app::V{'a'}) == 'a' + 2 ? 0 : 1;
+}
+CC
+
+$CXX --std=c++17 -O3 -I"$dir" -c "$tmp/extern.cc" -o "$tmp/extern.o" ||
+  fail "extern table compilation failed"
+
+nm -C "$tmp/extern.o" | grep -q 'visit_vtable' &&
+  fail "extern table instantiated in the user"
+nm -C "$tmp/extern.o" | grep -q ' U .*tools::visit_extern<' ||
+  fail "no reference to the extern table"
+
+$CXX --std=c++17 -O3 -I"$dir" "$tmp/instantiate.cc" "$tmp/extern.o" \
+  -o "$tmp/extern" || fail "extern table instantiation failed"
+"$tmp/extern" || fail "extern table visit failed"
+
+echo "static_tables_test: OK"
@@ -1,7 +1,31 @@
 #include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
 #include <numeric>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include <variant>
+#include <vector>
+
+#if __cplusplus > 201703L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#endif
+#endif
+
+#ifdef TOOLS_VISIT_INSTRUMENTATION
+#include <atomic>
+#include <new>
+#include <ostream>
+#include <string>
+#include <string_view>
+#endif
 
 namespace tools {
 
@@ -16,16 +40,20 @@ overload(Fs...)->overload<Fs...>;
 namespace simplified {
 
 template <typename F, typename... Ts>
-constexpr void visit(F f, const std::variant<Ts...>& v) {
-  using signature = void (*)(F, const std::variant<Ts...>&);
+using signature = void (*)(F, const std::variant<Ts...>&);
 
-  // clang-format off
-  static constexpr signature vtable[] {
-      [](F f, const std::variant<Ts...>& v) { f(std::get<Ts>(v)); } ...
-  };
-  // clang-format on
+// A constexpr function cannot have a static local, so the table lives in
+// a variable template: one read-only copy per <F, Ts...>.
+// clang-format off
+template <typename F, typename... Ts>
+inline constexpr signature<F, Ts...> vtable[] {
+    [](F f, const std::variant<Ts...>& v) { f(std::get<Ts>(v)); } ...
+};
+// clang-format on
 
-  vtable[v.index()](f, v);
+template <typename F, typename... Ts>
+constexpr void visit(F f, const std::variant<Ts...>& v) {
+  vtable<F, Ts...>[v.index()](f, v);
 }
 
 }  // namespace simplified
@@ -65,6 +93,10 @@ constexpr bool all_of(I f, I l, P p) {
   return true;
 }
 
+constexpr bool all_true(std::initializer_list<bool> xs) {
+  return all_of(xs.begin(), xs.end(), [](bool x) { return x; });
+}
+
 template <typename I>
 using ValueType = typename std::iterator_traits<I>::value_type;
 
@@ -114,10 +146,27 @@ struct type_list_impl<std::index_sequence<idxs...>, Ts...>
 template <typename... Ts>
 struct type_list : type_list_impl<std::index_sequence_for<Ts...>, Ts...> {};
 
+#if defined(__has_builtin)
+#if __has_builtin(__type_pack_element)
+#define TOOLS_VISIT_HAS_TYPE_PACK_ELEMENT
+#endif
+#if __has_builtin(__builtin_is_constant_evaluated)
+#define TOOLS_VISIT_HAS_IS_CONSTANT_EVALUATED
+#endif
+#endif
+
+#ifdef TOOLS_VISIT_HAS_TYPE_PACK_ELEMENT
+// O(1), no overload resolution against every base.
+template <size_t I, typename... Ts>
+constexpr type_t<__type_pack_element<I, Ts...>> get(const type_list<Ts...>&) {
+  return {};
+}
+#else
 template <size_t I, typename T>
 constexpr type_t<T> get(const indexed_t<T, I>&) {
   return {};
 }
+#endif
 
 template <typename, typename = void>
 struct common_type_impl {
@@ -130,9 +179,61 @@ struct common_type_impl<type_list<Ts...>,
   using type = type_t<std::common_type_t<Ts...>>;
 };
 
+// std::common_type recurses once per type, which does not scale to a
+// table of thousands of results. All the same types is the usual case,
+// otherwise the list is reduced in chunks.
+constexpr size_t common_type_chunk = 32;
+
+template <typename T, typename... Ts>
+constexpr bool all_same_v = all_true({std::is_same_v<T, Ts>...});
+
+template <typename List, size_t from, size_t... from0_to_n>
+constexpr auto common_type_of_chunk(std::index_sequence<from0_to_n...>) {
+  using chunk =
+      type_list<typename decltype(get<from + from0_to_n>(List{}))::type...>;
+  return typename common_type_impl<chunk>::type{};
+}
+
+template <typename... Ts, size_t... chunks>
+constexpr auto common_type_chunks(type_list<Ts...>,
+                                  std::index_sequence<chunks...>) {
+  constexpr size_t size = sizeof...(Ts);
+  return type_list<decltype(
+      common_type_of_chunk<type_list<Ts...>, chunks * common_type_chunk>(
+          std::make_index_sequence<
+              size - chunks * common_type_chunk < common_type_chunk
+                  ? size - chunks * common_type_chunk
+                  : common_type_chunk>{}))...>{};
+}
+
+template <typename... Ts>
+constexpr auto common_type(type_list<Ts...> t);
+
+template <typename... Ts>
+constexpr auto common_type_of_types(type_list<type_t<Ts>...>) {
+  return common_type(type_list<Ts...>{});
+}
+
+template <typename... Ts>
+constexpr auto common_type_of_types(type_list<Ts...>) {
+  return null_t{};
+}
+
 template <typename... Ts>
-auto common_type(type_list<Ts...> t) {
-  return typename common_type_impl<type_list<Ts...>>::type{};
+constexpr auto common_type(type_list<Ts...> t) {
+  constexpr size_t size = sizeof...(Ts);
+  if constexpr (size == 0) {
+    return null_t{};
+  } else if constexpr (all_same_v<Ts...>) {
+    return type_t<std::decay_t<typename decltype(get<0>(t))::type>>{};
+  } else if constexpr (size <= common_type_chunk) {
+    return typename common_type_impl<type_list<Ts...>>::type{};
+  } else {
+    constexpr size_t chunks =
+        (size + common_type_chunk - 1) / common_type_chunk;
+    return common_type_of_types(
+        common_type_chunks(t, std::make_index_sequence<chunks>{}));
+  }
 }
 
 template <size_t... dims>
@@ -143,6 +244,27 @@ constexpr auto compute_powers_a() {
   return res;
 }
 
+constexpr bool is_power_of_two(size_t x) {
+  return x && !(x & (x - 1));
+}
+
+constexpr size_t round_up_to_power_of_two(size_t x) {
+  size_t res = 1;
+  while (res < x) {
+    res *= 2;
+  }
+  return res;
+}
+
+constexpr size_t log2_of_power_of_two(size_t x) {
+  size_t res = 0;
+  while (x > 1) {
+    x /= 2;
+    ++res;
+  }
+  return res;
+}
+
 template <size_t... dims>
 struct table_index_math {
   using index_a = std::array<size_t, sizeof...(dims)>;
@@ -151,11 +273,38 @@ struct table_index_math {
   using index_s = std::index_sequence<idxs...>;
 
   static constexpr size_t size_linear = (dims * ...);
+  static constexpr index_a dims_a{dims...};
   static constexpr index_a powers_a = compute_powers_a<dims...>();
   static constexpr varying_notation notation{powers_a.begin(), powers_a.end()};
 
+  // All the strides are powers of two when all the dimensions but the first
+  // one are: then every digit is shifted into its own bits.
+  static constexpr bool power_of_two_strides =
+      all_of(powers_a.begin(), powers_a.end(), is_power_of_two);
+
+  static constexpr index_a shifts_a = [] {
+    index_a res{};
+    for (size_t i = 0; i < res.size(); ++i) {
+      res[i] = log2_of_power_of_two(powers_a[i]);
+    }
+    return res;
+  }();
+
+  // Unrolled over the digits with the strides as constants, so the
+  // compiler does not go through a loop over powers_a, and shifts and ors
+  // instead of multiplying and adding when it can.
+  template <size_t... ks>
+  static constexpr size_t as_linear_helper(const index_a& arr,
+                                           std::index_sequence<ks...>) {
+    if constexpr (power_of_two_strides) {
+      return (size_t{0} | ... | (arr[ks] << shifts_a[ks]));
+    } else {
+      return (size_t{0} + ... + (arr[ks] * powers_a[ks]));
+    }
+  }
+
   static constexpr size_t as_linear(const index_a& arr) {
-    return notation.from(arr.begin());
+    return as_linear_helper(arr, std::make_index_sequence<sizeof...(dims)>{});
   }
 
   template <size_t... idxs>
@@ -169,15 +318,24 @@ struct table_index_math {
     return res;
   }
 
-  template <size_t idx, size_t... from0_to_n>
-  static constexpr auto as_multi_s_helper(std::index_sequence<from0_to_n...>) {
-    constexpr index_a as_a = as_multi_a(idx);
-    return index_s<as_a[from0_to_n]...>{};
-  }
+  template <typename>
+  struct multi_s_helper;
+
+  template <size_t... ks>
+  struct multi_s_helper<std::index_sequence<ks...>> {
+    template <size_t idx>
+    using type = index_s<idx / powers_a[ks] % dims_a[ks]...>;
+  };
+
+  // Every digit straight from the linear index: no constexpr loop and no
+  // function to instantiate per entry.
+  template <size_t idx>
+  using multi_s = typename multi_s_helper<
+      std::make_index_sequence<sizeof...(dims)>>::template type<idx>;
 
   template <size_t idx>
   static constexpr auto as_multi_s() {
-    return as_multi_s_helper<idx>(std::make_index_sequence<sizeof...(dims)>{});
+    return multi_s<idx>{};
   };
 };
 
@@ -226,10 +384,8 @@ constexpr OutTable table_map_helper(Table t,
                                     Op op,
                                     std::index_sequence<from0_to_n...>) {
   using math = typename Table::math;
-  return OutTable{[&] {
-    constexpr auto multi_s = math::template as_multi_s<from0_to_n>();
-    return op(multi_s, t.data[from0_to_n]);
-  }()...};
+  return OutTable{
+      op(typename math::template multi_s<from0_to_n>{}, t.data[from0_to_n])...};
 }
 
 template <typename T, size_t... dims, typename Op>
@@ -258,8 +414,9 @@ constexpr auto type_table_map_helper(Table,
                                      Op op,
                                      std::index_sequence<from0_to_n...>) {
   using UTypeList =
-      type_list<typename decltype(op(Table::template as_multi_s<from0_to_n>(),
-                                     get<from0_to_n>(Table{})))::type...>;
+      type_list<typename decltype(
+          op(typename Table::template multi_s<from0_to_n>{},
+             get<from0_to_n>(Table{})))::type...>;
   return typename Table::template same_dims_table<UTypeList>{};
 }
 
@@ -292,124 +449,1184 @@ constexpr auto make_type_table(Op op) {
                    [&](auto seq, auto) { return op(seq); });
 }
 
+[[noreturn]] inline void unreachable() {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_unreachable();
+#elif defined(_MSC_VER)
+  __assume(false);
+#else
+  std::abort();
+#endif
+}
+
+// Calls op(std::integral_constant<size_t, idx>{}) through a switch, so that
+// op can be inlined and the compiler builds the jump table itself.
+// Indices past one block of cases go to a nested switch.
+template <typename R, size_t size, size_t offset = 0, typename Op>
+constexpr R switch_on_index(size_t idx, Op&& op) {
+  // clang-format off
+#define TOOLS_VISIT_CASE(i)                                    \
+  case offset + i:                                             \
+    if constexpr (offset + i < size) {                         \
+      return op(std::integral_constant<size_t, offset + i>{}); \
+    }                                                          \
+    break;
+
+  switch (idx) {
+    TOOLS_VISIT_CASE(0)  TOOLS_VISIT_CASE(1)  TOOLS_VISIT_CASE(2)
+    TOOLS_VISIT_CASE(3)  TOOLS_VISIT_CASE(4)  TOOLS_VISIT_CASE(5)
+    TOOLS_VISIT_CASE(6)  TOOLS_VISIT_CASE(7)  TOOLS_VISIT_CASE(8)
+    TOOLS_VISIT_CASE(9)  TOOLS_VISIT_CASE(10) TOOLS_VISIT_CASE(11)
+    TOOLS_VISIT_CASE(12) TOOLS_VISIT_CASE(13) TOOLS_VISIT_CASE(14)
+    TOOLS_VISIT_CASE(15) TOOLS_VISIT_CASE(16) TOOLS_VISIT_CASE(17)
+    TOOLS_VISIT_CASE(18) TOOLS_VISIT_CASE(19) TOOLS_VISIT_CASE(20)
+    TOOLS_VISIT_CASE(21) TOOLS_VISIT_CASE(22) TOOLS_VISIT_CASE(23)
+    TOOLS_VISIT_CASE(24) TOOLS_VISIT_CASE(25) TOOLS_VISIT_CASE(26)
+    TOOLS_VISIT_CASE(27) TOOLS_VISIT_CASE(28) TOOLS_VISIT_CASE(29)
+    TOOLS_VISIT_CASE(30) TOOLS_VISIT_CASE(31)
+    default: break;
+  }
+
+#undef TOOLS_VISIT_CASE
+  // clang-format on
+
+  if constexpr (offset + 32 < size) {
+    return switch_on_index<R, size, offset + 32>(idx, std::forward<Op>(op));
+  } else {
+    unreachable();
+  }
+}
+
+// Compares idx with every index in order, the last one is not checked.
+template <typename R, size_t size, size_t i = 0, typename Op>
+constexpr R if_else_on_index(size_t idx, Op&& op) {
+  if constexpr (i + 1 == size) {
+    return op(std::integral_constant<size_t, i>{});
+  } else {
+    if (idx == i) {
+      return op(std::integral_constant<size_t, i>{});
+    }
+    return if_else_on_index<R, size, i + 1>(idx, std::forward<Op>(op));
+  }
+}
+
+// Halves [from, to) until one index is left: log2(size) compares.
+template <typename R, size_t from, size_t to, typename Op>
+constexpr R binary_search_on_index(size_t idx, Op&& op) {
+  if constexpr (to - from == 1) {
+    return op(std::integral_constant<size_t, from>{});
+  } else {
+    constexpr size_t middle = from + (to - from) / 2;
+    if (idx < middle) {
+      return binary_search_on_index<R, from, middle>(idx, std::forward<Op>(op));
+    }
+    return binary_search_on_index<R, middle, to>(idx, std::forward<Op>(op));
+  }
+}
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define TOOLS_VISIT_HAS_EXCEPTIONS 1
+#else
+#define TOOLS_VISIT_HAS_EXCEPTIONS 0
+#endif
+
+// Called for a valueless variant when exceptions are disabled.
+// Must not return: i.e. -DTOOLS_VISIT_VALUELESS_HANDLER=my_log_and_abort
+#ifndef TOOLS_VISIT_VALUELESS_HANDLER
+#define TOOLS_VISIT_VALUELESS_HANDLER std::abort
+#endif
+
+[[noreturn]] inline void throw_bad_variant_access() {
+#if TOOLS_VISIT_HAS_EXCEPTIONS
+  throw std::bad_variant_access{};
+#else
+  TOOLS_VISIT_VALUELESS_HANDLER();
+  std::abort();
+#endif
+}
+
+// std::get for the dispatch engine only: the dispatch has already proven
+// the index, so there is no check and no throw path left in the thunks.
+template <size_t idx, typename FwdV>
+constexpr decltype(auto) unchecked_get(FwdV&& v) {
+  assert(v.index() == idx);
+  if (v.index() != idx) {
+    unreachable();
+  }
+  return std::get<idx>(std::forward<FwdV>(v));
+}
+
+template <typename T>
+struct all_nothrow_move_constructible;
+
+template <typename... Ts>
+struct all_nothrow_move_constructible<std::variant<Ts...>>
+    : std::conjunction<std::is_nothrow_move_constructible<Ts>...> {};
+
+// Opt-in for variants that are known to never be valueless_by_exception:
+// their tables have no valueless slot. Requires nothrow moves for all
+// alternatives, and no emplace/assignment that can throw half way.
+template <typename V>
+struct never_valueless : std::false_type {};
+
+template <typename V>
+constexpr size_t valueless_slots_helper() {
+  if constexpr (never_valueless<V>::value) {
+    static_assert(all_nothrow_move_constructible<V>::value,
+                  "never_valueless requires nothrow moves");
+    return 0;
+  } else {
+    return 1;
+  }
+}
+
+// Dispatch indices: every variant that can be valueless gets an extra
+// slot 0 for it and index() + 1 turns variant_npos into that slot
+// without a branch.
+template <typename V>
+constexpr size_t valueless_slots = valueless_slots_helper<V>();
+
+template <typename V>
+constexpr size_t dispatch_size = std::variant_size_v<V> + valueless_slots<V>;
+
+template <typename V>
+constexpr size_t slot_index(const V& v) {
+  assert(valueless_slots<V> || !v.valueless_by_exception());
+  return v.index() + valueless_slots<V>;
+}
+
+// Opt-in for alternatives that are rarely visited, i.e. errors or
+// shutdown messages: every entry with one of them calls a cold, never
+// inlined thunk, so that their code goes out of the way of the hot ones
+// (.text.unlikely with gcc and clang).
+template <typename T>
+struct is_cold_alternative : std::false_type {};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TOOLS_VISIT_COLD __attribute__((cold, noinline))
+#elif defined(_MSC_VER)
+#define TOOLS_VISIT_COLD __declspec(noinline)
+#else
+#define TOOLS_VISIT_COLD
+#endif
+
 template <typename R, typename FwdOp, typename... FwdVs>
 struct visit_vtable_generator {
   using vtable_element = R (*)(FwdOp, FwdVs...);
 
+  template <size_t... ds>
+  static constexpr bool is_valueless(std::index_sequence<ds...>) {
+    return ((ds < valueless_slots<std::decay_t<FwdVs>>) || ...);
+  }
+
+  template <size_t... ds>
+  using alternatives_s =
+      std::index_sequence<(ds - valueless_slots<std::decay_t<FwdVs>>)...>;
+
   template <size_t... idxs>
-  constexpr vtable_element operator()(std::index_sequence<idxs...>) const {
-    return [](FwdOp op, FwdVs... vs) -> R {
-      return std::forward<FwdOp>(op)(
-          std::get<idxs>(std::forward<FwdVs>(vs))...);
-    };
+  static constexpr R invoke(std::index_sequence<idxs...>,
+                            FwdOp op,
+                            FwdVs... vs) {
+    return std::forward<FwdOp>(op)(
+        unchecked_get<idxs>(std::forward<FwdVs>(vs))...);
+  }
+
+  template <size_t... idxs>
+  static constexpr bool is_cold(std::index_sequence<idxs...>) {
+    return (is_cold_alternative<std::variant_alternative_t<
+                idxs, std::decay_t<FwdVs>>>::value ||
+            ...);
+  }
+
+  template <size_t... idxs>
+  TOOLS_VISIT_COLD static constexpr R cold(FwdOp op, FwdVs... vs) {
+    return invoke(std::index_sequence<idxs...>{}, std::forward<FwdOp>(op),
+                  std::forward<FwdVs>(vs)...);
+  }
+
+  template <size_t... idxs>
+  static constexpr vtable_element cold_ptr(std::index_sequence<idxs...>) {
+    return &cold<idxs...>;
+  }
+
+  // The one thunk for all the entries with a valueless variant.
+  [[noreturn]] TOOLS_VISIT_COLD static R valueless(FwdOp, FwdVs...) {
+    throw_bad_variant_access();
+  }
+
+  // Same as the thunk for the dispatch indices ds, without the table.
+  template <size_t... ds>
+  static constexpr R dispatch(std::index_sequence<ds...> seq,
+                              FwdOp op,
+                              FwdVs... vs) {
+    if constexpr (is_valueless(seq)) {
+      valueless(std::forward<FwdOp>(op), std::forward<FwdVs>(vs)...);
+    } else if constexpr (is_cold(alternatives_s<ds...>{})) {
+      return cold_ptr(alternatives_s<ds...>{})(std::forward<FwdOp>(op),
+                                               std::forward<FwdVs>(vs)...);
+    } else {
+      return invoke(alternatives_s<ds...>{}, std::forward<FwdOp>(op),
+                    std::forward<FwdVs>(vs)...);
+    }
+  }
+
+  template <size_t... ds>
+  constexpr vtable_element operator()(std::index_sequence<ds...> seq) const {
+    if constexpr (is_valueless(seq)) {
+      return &valueless;
+    } else if constexpr (is_cold(alternatives_s<ds...>{})) {
+      return cold_ptr(alternatives_s<ds...>{});
+    } else {
+      return [](FwdOp op, FwdVs... vs) -> R {
+        return invoke(alternatives_s<ds...>{}, std::forward<FwdOp>(op),
+                      std::forward<FwdVs>(vs)...);
+      };
+    }
   }
 };
 
+constexpr size_t cache_line_size = 64;
+
+template <typename... Vs>
+using visit_index_math = table_index_math<dispatch_size<Vs>...>;
+
+// A local constexpr table indexed with a runtime value is allowed to be
+// rebuilt on the stack on every call. A variable template is emitted once
+// as constant data and folded across translation units by the linker.
+template <typename R, typename FwdOp, typename... FwdVs>
+alignas(cache_line_size) inline constexpr auto visit_vtable =
+    make_table<dispatch_size<std::decay_t<FwdVs>>...>(
+        visit_vtable_generator<R, FwdOp, FwdVs...>{});
+
 template <typename R, typename Op, typename... Vs>
 constexpr R visit_with_r_simplified(Op&& op, Vs&&... vs) {
-  constexpr visit_vtable_generator<R, decltype(std::forward<Op>(op)),
-                                   decltype(std::forward<Vs>(vs))...>
-      vtable_generator;
+  constexpr auto& vtable = visit_vtable<R, decltype(std::forward<Op>(op)),
+                                        decltype(std::forward<Vs>(vs))...>;
 
-  constexpr auto vtable =
-      make_table<std::variant_size_v<std::decay_t<Vs>>...>(vtable_generator);
+  return vtable[{slot_index(vs)...}](std::forward<Op>(op),
+                                     std::forward<Vs>(vs)...);
+}
 
-  return vtable[{vs.index()...}](std::forward<Op>(op), std::forward<Vs>(vs)...);
+template <typename... Vs>
+constexpr size_t visit_linear_index(const Vs&... vs) {
+  return visit_index_math<Vs...>::as_linear({slot_index(vs)...});
 }
 
-template <typename R, typename Op, typename... Vs>
-constexpr R visit_with_r(Op&& op, Vs&&... vs) {
-  constexpr visit_vtable_generator<R, decltype(std::forward<Op>(op)),
-                                   decltype(std::forward<Vs>(vs))...>
-      vtable_generator;
+// Dispatch strategies ---------------------------------------------------
+//
+// A strategy is a tag that can be passed as the first argument of
+// visit/visit_with_r. It gets the forwarded visitor and variants and
+// decides how to get from their indices to the call.
+
+struct dispatch_strategy {};
+
+template <typename T>
+constexpr bool is_dispatch_strategy_v =
+    std::is_base_of_v<dispatch_strategy, std::decay_t<T>>;
+
+// Common part of the strategies that only differ in how they turn
+// the linear index into a compile time constant.
+template <typename R, typename OnIndex, typename Op, typename... Vs>
+constexpr R visit_with_r_on_index(OnIndex, Op&& op, Vs&&... vs) {
+  using math = visit_index_math<std::decay_t<Vs>...>;
+  using generator = visit_vtable_generator<R, decltype(std::forward<Op>(op)),
+                                           decltype(std::forward<Vs>(vs))...>;
+
+  return OnIndex::template on_index<R, math::size_linear>(
+      visit_linear_index(vs...), [&](auto linear) -> R {
+        return generator::dispatch(typename math::template multi_s<linear>{},
+                                   std::forward<Op>(op),
+                                   std::forward<Vs>(vs)...);
+      });
+}
+
+struct flat_table_dispatch : dispatch_strategy {
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    constexpr auto& vtable = visit_vtable<R, decltype(std::forward<Op>(op)),
+                                          decltype(std::forward<Vs>(vs))...>;
 
-  constexpr auto vtable =
-      make_table<std::variant_size_v<std::decay_t<Vs>>...>(vtable_generator);
+    return vtable.data[visit_linear_index(vs...)](std::forward<Op>(op),
+                                                  std::forward<Vs>(vs)...);
+  }
+};
+
+struct switch_dispatch : dispatch_strategy {
+  template <typename R, size_t size, typename Op>
+  static constexpr R on_index(size_t idx, Op&& op) {
+    return switch_on_index<R, size>(idx, std::forward<Op>(op));
+  }
+
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    return visit_with_r_on_index<R>(switch_dispatch{}, std::forward<Op>(op),
+                                    std::forward<Vs>(vs)...);
+  }
+};
+
+struct if_else_dispatch : dispatch_strategy {
+  template <typename R, size_t size, typename Op>
+  static constexpr R on_index(size_t idx, Op&& op) {
+    return if_else_on_index<R, size>(idx, std::forward<Op>(op));
+  }
+
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    return visit_with_r_on_index<R>(if_else_dispatch{}, std::forward<Op>(op),
+                                    std::forward<Vs>(vs)...);
+  }
+};
+
+struct binary_search_dispatch : dispatch_strategy {
+  template <typename R, size_t size, typename Op>
+  static constexpr R on_index(size_t idx, Op&& op) {
+    return binary_search_on_index<R, 0, size>(idx, std::forward<Op>(op));
+  }
+
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    return visit_with_r_on_index<R>(binary_search_dispatch{},
+                                    std::forward<Op>(op),
+                                    std::forward<Vs>(vs)...);
+  }
+};
+
+// Dispatches on one variant at a time: the thunk chosen for the first
+// variant dispatches on the second one and so on, the last one goes through
+// a switch. Every table on the way has as many entries as its variant has
+// alternatives and no table of the size of the whole product is built.
+// The visitor itself is still instantiated for every combination.
+template <typename R, typename FwdOp, typename... FwdVs>
+struct nested_dispatch_generator {
+  using vtable_element = R (*)(FwdOp, FwdVs...);
+  using invoker = visit_vtable_generator<R, FwdOp, FwdVs...>;
+
+  template <size_t level>
+  using variant_at =
+      std::decay_t<std::tuple_element_t<level, std::tuple<FwdVs...>>>;
+
+  template <size_t level>
+  static constexpr size_t level_size = dispatch_size<variant_at<level>>;
+
+  // Valueless slots skip the remaining levels.
+  template <size_t... idxs, size_t next>
+  static constexpr vtable_element level_entry(
+      std::integral_constant<size_t, next>) {
+    if constexpr (next < valueless_slots<variant_at<sizeof...(idxs)>>) {
+      return &invoker::valueless;
+    } else {
+      return &step<idxs..., next>;
+    }
+  }
+
+  template <size_t... idxs, size_t... next>
+  static constexpr auto make_level_table(std::index_sequence<next...>) {
+    return std::array<vtable_element, sizeof...(next)>{
+        level_entry<idxs...>(std::integral_constant<size_t, next>{})...};
+  }
+
+  template <size_t... idxs>
+  alignas(cache_line_size) static constexpr auto level_table =
+      make_level_table<idxs...>(
+          std::make_index_sequence<level_size<sizeof...(idxs)>>{});
+
+  template <size_t... idxs>
+  static constexpr R step(FwdOp op, FwdVs... vs) {
+    constexpr size_t level = sizeof...(idxs);
+
+    size_t idx = slot_index(std::get<level>(std::tie(vs...)));
+
+    if constexpr (level + 1 == sizeof...(FwdVs)) {
+      return switch_on_index<R, level_size<level>>(idx, [&](auto i) -> R {
+        return invoker::dispatch(std::index_sequence<idxs..., i>{},
+                                 std::forward<FwdOp>(op),
+                                 std::forward<FwdVs>(vs)...);
+      });
+    } else {
+      return level_table<idxs...>[idx](std::forward<FwdOp>(op),
+                                       std::forward<FwdVs>(vs)...);
+    }
+  }
+};
+
+struct nested_dispatch : dispatch_strategy {
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    using generator =
+        nested_dispatch_generator<R, decltype(std::forward<Op>(op)),
+                                  decltype(std::forward<Vs>(vs))...>;
+    return generator::step(std::forward<Op>(op), std::forward<Vs>(vs)...);
+  }
+};
+
+// Compressed tables ------------------------------------------------------
+//
+// Two entries resolve to the same overload with the same conversions when
+// all the variants have the same alternative types at their indices.
+// The compressed table stores one thunk per such class and a small offset
+// per entry instead of a full pointer.
+
+template <typename V, size_t i, size_t... from0_to_n>
+constexpr size_t first_same_alternative(std::index_sequence<from0_to_n...>) {
+  constexpr bool same[] = {
+      std::is_same_v<std::variant_alternative_t<i, V>,
+                     std::variant_alternative_t<from0_to_n, V>>...};
+  size_t res = 0;
+  while (!same[res]) {
+    ++res;
+  }
+  return res;
+}
+
+template <typename V, size_t... from0_to_n>
+constexpr auto canonical_alternatives_helper(
+    std::index_sequence<from0_to_n...> seq) {
+  return std::array<size_t, sizeof...(from0_to_n)>{
+      first_same_alternative<V, from0_to_n>(seq)...};
+}
+
+// For every alternative: the index of the first one with the same type.
+template <typename V>
+inline constexpr auto canonical_alternatives =
+    canonical_alternatives_helper<V>(
+        std::make_index_sequence<std::variant_size_v<V>>{});
+
+template <typename V>
+constexpr size_t next_same_alternative(size_t idx, size_t from) {
+  while (from != std::variant_size_v<V> &&
+         canonical_alternatives<V>[from] != idx) {
+    ++from;
+  }
+  return from;
+}
+
+// Like unchecked_get<idx> for the first alternative of its type, but any
+// other active index that holds the same type is accepted too, so that one
+// thunk can serve all of them.
+template <size_t idx, size_t from = idx, typename FwdV>
+constexpr decltype(auto) get_same_type(FwdV v) {
+  using V = std::decay_t<FwdV>;
+  constexpr size_t next = next_same_alternative<V>(idx, from + 1);
+
+  if constexpr (next == std::variant_size_v<V>) {
+    return unchecked_get<from>(std::forward<FwdV>(v));
+  } else {
+    if (v.index() == from) {
+      return unchecked_get<from>(std::forward<FwdV>(v));
+    }
+    return get_same_type<idx, next, FwdV>(std::forward<FwdV>(v));
+  }
+}
+
+// canonical_alternatives in dispatch indices.
+template <typename V, size_t... from0_to_n>
+constexpr auto canonical_dispatch_helper(std::index_sequence<from0_to_n...>) {
+  constexpr size_t slots = valueless_slots<V>;
+  return std::array<size_t, sizeof...(from0_to_n)>{
+      (from0_to_n < slots
+           ? from0_to_n
+           : canonical_alternatives<V>[from0_to_n - slots] + slots)...};
+}
+
+template <typename V>
+inline constexpr auto canonical_dispatch = canonical_dispatch_helper<V>(
+    std::make_index_sequence<dispatch_size<V>>{});
+
+template <size_t size>
+using offset_t = std::conditional_t<
+    size <= 0x100,
+    std::uint8_t,
+    std::conditional_t<size <= 0x10000, std::uint16_t, std::uint32_t>>;
+
+template <typename R, typename FwdOp, typename... FwdVs>
+struct compressed_vtable {
+  using math = visit_index_math<std::decay_t<FwdVs>...>;
+  using generator = visit_vtable_generator<R, FwdOp, FwdVs...>;
+  using vtable_element = R (*)(FwdOp, FwdVs...);
 
-  size_t idx = vtable.as_linear({vs.index()...});
-  if (idx >= vtable.data.size()) {
-    idx = 0;
+  static constexpr size_t size_linear = math::size_linear;
+
+  // All the valueless entries collapse into entry 0: the slots are first.
+  static constexpr size_t canonical_entry(size_t idx) {
+    constexpr std::array<const size_t*, sizeof...(FwdVs)> canonical{
+        canonical_dispatch<std::decay_t<FwdVs>>.data()...};
+    constexpr std::array<size_t, sizeof...(FwdVs)> slots{
+        valueless_slots<std::decay_t<FwdVs>>...};
+
+    auto multi = math::as_multi_a(idx);
+    for (size_t i = 0; i < multi.size(); ++i) {
+      if (multi[i] < slots[i]) {
+        return 0;
+      }
+      multi[i] = canonical[i][multi[i]];
+    }
+    return math::as_linear(multi);
+  }
+
+  static constexpr size_t unique_size = [] {
+    size_t res = 0;
+    for (size_t i = 0; i < size_linear; ++i) {
+      res += canonical_entry(i) == i;
+    }
+    return res;
+  }();
+
+  using offset_type = offset_t<unique_size>;
+
+  static constexpr auto unique_entries = [] {
+    std::array<size_t, unique_size> res{};
+    for (size_t i = 0, o = 0; i < size_linear; ++i) {
+      if (canonical_entry(i) == i) {
+        res[o++] = i;
+      }
+    }
+    return res;
+  }();
+
+  template <size_t... idxs>
+  static constexpr R thunk(FwdOp op, FwdVs... vs) {
+    return std::forward<FwdOp>(op)(
+        get_same_type<idxs, idxs, FwdVs>(std::forward<FwdVs>(vs))...);
+  }
+
+  template <size_t... ds>
+  static constexpr vtable_element thunk_ptr(std::index_sequence<ds...> seq) {
+    if constexpr (generator::is_valueless(seq)) {
+      return &generator::valueless;
+    } else {
+      return thunk_ptr_a(typename generator::template alternatives_s<ds...>{});
+    }
+  }
+
+  template <size_t... idxs>
+  static constexpr vtable_element thunk_ptr_a(std::index_sequence<idxs...>) {
+    return &thunk<idxs...>;
+  }
+
+  template <size_t... from0_to_n>
+  static constexpr auto make_thunks(std::index_sequence<from0_to_n...>) {
+    return std::array<vtable_element, unique_size>{thunk_ptr(
+        typename math::template multi_s<unique_entries[from0_to_n]>{})...};
+  }
+
+  alignas(cache_line_size) static constexpr auto thunks =
+      make_thunks(std::make_index_sequence<unique_size>{});
+
+  alignas(cache_line_size) static constexpr auto offsets = [] {
+    std::array<offset_type, size_linear> res{};
+    for (size_t i = 0, o = 0; i < size_linear; ++i) {
+      // The canonical entry is never after the ones it stands for.
+      size_t canonical = canonical_entry(i);
+      res[i] = canonical == i ? static_cast<offset_type>(o++) : res[canonical];
+    }
+    return res;
+  }();
+
+  // Compile time report, i.e. static_assert(table::dedup_ratio > 2). The
+  // sizes are the cache lines the aligned tables take, not the entries.
+  static constexpr size_t aligned_bytes(size_t bytes) {
+    return (bytes + cache_line_size - 1) / cache_line_size * cache_line_size;
   }
 
-  return vtable.data[idx](std::forward<Op>(op), std::forward<Vs>(vs)...);
+  static constexpr size_t flat_bytes =
+      aligned_bytes(size_linear * sizeof(vtable_element));
+  static constexpr size_t compressed_bytes =
+      aligned_bytes(sizeof(offsets)) + aligned_bytes(sizeof(thunks));
+  static constexpr double dedup_ratio =
+      static_cast<double>(size_linear) / unique_size;
+};
+
+// Only entries that call the same thunk are shared: the ones of duplicate
+// alternative types and the valueless ones. Variants of distinct types
+// hardly shrink, e.g. 8 distinct alternatives visited 2-way dedup by
+// 1.25, and every call pays a second dependent load for the offset. Check
+// compressed_vtable::compressed_bytes against flat_bytes before opting in.
+struct compressed_table_dispatch : dispatch_strategy {
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    using vtable = compressed_vtable<R, decltype(std::forward<Op>(op)),
+                                     decltype(std::forward<Vs>(vs))...>;
+
+    return vtable::thunks[vtable::offsets[visit_linear_index(vs...)]](
+        std::forward<Op>(op), std::forward<Vs>(vs)...);
+  }
+};
+
+// Every dimension rounded up to a power of two, so the linear index is
+// the dispatch indices shifted and or-ed together: no multiplies. The
+// extra entries are never reached and point at the valueless thunk.
+// Measured with visit_benchmark it is no faster than flat_table: within
+// noise for 1 and 3 variants, 10% to 50% slower for 2 variants of 8 on
+// random input, with 2 to 6 times the table bytes. The multiplies are
+// cheap next to the table load and the indirect call. Kept as an opt-in
+// for targets with slow multiplies, not picked by auto_dispatch.
+template <typename V>
+constexpr size_t padded_dispatch_size =
+    round_up_to_power_of_two(dispatch_size<V>);
+
+template <typename... Vs>
+using padded_index_math = table_index_math<padded_dispatch_size<Vs>...>;
+
+template <typename R, typename FwdOp, typename... FwdVs>
+struct padded_vtable_generator : visit_vtable_generator<R, FwdOp, FwdVs...> {
+  using base = visit_vtable_generator<R, FwdOp, FwdVs...>;
+  using vtable_element = typename base::vtable_element;
+
+  template <size_t... ds>
+  constexpr vtable_element operator()(std::index_sequence<ds...> seq) const {
+    if constexpr (((ds >= dispatch_size<std::decay_t<FwdVs>>) || ...)) {
+      return &base::valueless;
+    } else {
+      return base::operator()(seq);
+    }
+  }
+};
+
+template <typename R, typename FwdOp, typename... FwdVs>
+alignas(cache_line_size) inline constexpr auto padded_visit_vtable =
+    make_table<padded_dispatch_size<std::decay_t<FwdVs>>...>(
+        padded_vtable_generator<R, FwdOp, FwdVs...>{});
+
+template <typename... Vs>
+constexpr size_t padded_linear_index(const Vs&... vs) {
+  static_assert(padded_index_math<Vs...>::power_of_two_strides);
+  return padded_index_math<Vs...>::as_linear({slot_index(vs)...});
 }
 
+struct padded_table_dispatch : dispatch_strategy {
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    constexpr auto& vtable =
+        padded_visit_vtable<R, decltype(std::forward<Op>(op)),
+                            decltype(std::forward<Vs>(vs))...>;
+
+    return vtable.data[padded_linear_index(vs...)](std::forward<Op>(op),
+                                                   std::forward<Vs>(vs)...);
+  }
+};
+
+#ifndef TOOLS_VISIT_IF_ELSE_MAX_SIZE
+#define TOOLS_VISIT_IF_ELSE_MAX_SIZE 3
+#endif
+
+#ifndef TOOLS_VISIT_SWITCH_MAX_SIZE
+#define TOOLS_VISIT_SWITCH_MAX_SIZE 16
+#endif
+
+#ifndef TOOLS_VISIT_NESTED_MIN_SIZE
+#define TOOLS_VISIT_NESTED_MIN_SIZE 1024
+#endif
+
+// Picks a strategy from the size of the table: an if-else chain for tiny
+// ones, a switch for small ones, the function pointer table for the rest
+// unless it is a multi visit whose table would have nested_min_size
+// entries or more, then it dispatches one variant at a time.
+// Sizes count the valueless slots: variant<int, char> is 3.
+// The defaults can be changed per call site: auto_dispatch<1, 64>{}.
+template <size_t if_else_max_size = TOOLS_VISIT_IF_ELSE_MAX_SIZE,
+          size_t switch_max_size = TOOLS_VISIT_SWITCH_MAX_SIZE,
+          size_t nested_min_size = TOOLS_VISIT_NESTED_MIN_SIZE>
+struct auto_dispatch : dispatch_strategy {
+  template <typename... Vs>
+  static constexpr auto select() {
+    constexpr size_t size = visit_index_math<Vs...>::size_linear;
+
+    if constexpr (size <= if_else_max_size) {
+      return if_else_dispatch{};
+    } else if constexpr (size <= switch_max_size) {
+      return switch_dispatch{};
+    } else if constexpr (sizeof...(Vs) > 1 && size >= nested_min_size) {
+      return nested_dispatch{};
+    } else {
+      return flat_table_dispatch{};
+    }
+  }
+
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    using selected = decltype(select<std::decay_t<Vs>...>());
+    return selected::template visit<R>(std::forward<Op>(op),
+                                       std::forward<Vs>(vs)...);
+  }
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TOOLS_VISIT_LIKELY(x) __builtin_expect(!!(x), 1)
+#else
+#define TOOLS_VISIT_LIKELY(x) (x)
+#endif
+
+// For visits that are mostly one combination of alternatives: one compare
+// per variant and a direct, inlinable call when they are the predicted
+// ones, the Fallback strategy otherwise.
+//   visit(likely_dispatch<1, 0>{}, op, quote_or_trade, side);
+template <typename Fallback, size_t... likely_idxs>
+struct likely_dispatch_with : dispatch_strategy {
+  template <typename R, typename Op, typename... Vs>
+  static constexpr R visit(Op&& op, Vs&&... vs) {
+    static_assert(sizeof...(likely_idxs) == sizeof...(Vs),
+                  "one predicted index per variant");
+    using generator = visit_vtable_generator<R, decltype(std::forward<Op>(op)),
+                                             decltype(std::forward<Vs>(vs))...>;
+
+    if (TOOLS_VISIT_LIKELY(((vs.index() == likely_idxs) && ...))) {
+      return generator::invoke(std::index_sequence<likely_idxs...>{},
+                               std::forward<Op>(op), std::forward<Vs>(vs)...);
+    }
+    return Fallback::template visit<R>(std::forward<Op>(op),
+                                       std::forward<Vs>(vs)...);
+  }
+};
+
+template <size_t... likely_idxs>
+using likely_dispatch = likely_dispatch_with<auto_dispatch<>, likely_idxs...>;
+
+// Instrumentation -------------------------------------------------------
+//
+// -DTOOLS_VISIT_INSTRUMENTATION counts the dispatches to every entry of
+// every visit table. A table is one R, op and variant types: in practice
+// one per call site, as every lambda is its own type.
+//   tools::instrumentation::write_csv(std::cout);
+// Every thread increments its own counters and readers sum them up, so
+// there are no locks and no atomic read-modify-writes when visiting.
+// Counters are never freed: the counts of finished threads stay.
+// Without the macro none of this is compiled.
+
+#ifdef TOOLS_VISIT_INSTRUMENTATION
+
+namespace instrumentation {
+
+// Best effort, from the compiler's own spelling.
 template <typename T>
-struct is_variant : std::false_type {};
+std::string_view type_name() {
+#if defined(__clang__) || defined(__GNUC__)
+  std::string_view name = __PRETTY_FUNCTION__;
+  size_t first = name.find("T = ") + 4;
+  size_t last = name.find(';', first);
+  if (last == std::string_view::npos) {
+    last = name.rfind(']');
+  }
+  return name.substr(first, last - first);
+#elif defined(_MSC_VER)
+  std::string_view name = __FUNCSIG__;
+  size_t first = name.find("type_name<") + 10;
+  return name.substr(first, name.rfind(">(void)") - first);
+#else
+  return "?";
+#endif
+}
 
 template <typename... Ts>
-struct is_variant<std::variant<Ts...>> : std::true_type {};
+std::string_view alternative_name(const std::variant<Ts...>*, size_t idx) {
+  const std::string_view names[] = {type_name<Ts>()...};
+  return names[idx];
+}
 
-template <typename T>
-constexpr bool is_variant_v = is_variant<T>::value;
+template <typename V>
+std::string_view dispatch_name(size_t idx) {
+  if (idx < valueless_slots<V>) {
+    return "valueless";
+  }
+  return alternative_name(static_cast<const V*>(nullptr),
+                          idx - valueless_slots<V>);
+}
+
+struct thread_counters {
+  std::atomic<std::uint64_t>* counts;
+  thread_counters* next;
+};
+
+struct site {
+  std::string_view result;
+  std::string_view visitor;
+  size_t size;
+  // The alternatives of every variant for an entry: "int char".
+  std::string (*entry_name)(size_t);
+  std::atomic<thread_counters*> threads{nullptr};
+  site* next = nullptr;
+
+  std::uint64_t count(size_t entry) const {
+    std::uint64_t res = 0;
+    for (auto* t = threads.load(std::memory_order_acquire); t; t = t->next) {
+      res += t->counts[entry].load(std::memory_order_relaxed);
+    }
+    return res;
+  }
+
+  // nullptr when out of memory: that thread is not counted.
+  thread_counters* add_thread() noexcept {
+    auto* t = new (std::nothrow) thread_counters{
+        new (std::nothrow) std::atomic<std::uint64_t>[size](), nullptr};
+    if (!t || !t->counts) {
+      delete t;
+      return nullptr;
+    }
+    push(threads, t);
+    return t;
+  }
+
+  template <typename T>
+  static void push(std::atomic<T*>& head, T* x) noexcept {
+    x->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(x->next, x, std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+};
+
+inline std::atomic<site*> sites{nullptr};
 
 template <typename R, typename FwdOp, typename... FwdVs>
-struct should_enable_visit_r_helper {
-  template <size_t... idxs>
-  constexpr bool operator()(std::index_sequence<idxs...>) {
-    return std::is_invocable_r_v<
-        R, FwdOp, decltype(std::get<idxs>(std::declval<FwdVs>()))...>;
+struct site_of {
+  using math = visit_index_math<std::decay_t<FwdVs>...>;
+
+  static std::string entry_name(size_t entry) {
+    auto multi = math::as_multi_a(entry);
+    std::string res;
+    size_t i = 0;
+    ((res += i ? " " : "",
+      res += dispatch_name<std::decay_t<FwdVs>>(multi[i]), ++i),
+     ...);
+    return res;
+  }
+
+  static site& get() noexcept {
+    static site s{type_name<R>(), type_name<FwdOp>(), math::size_linear,
+                  &entry_name};
+    static const bool registered = (site::push(sites, &s), true);
+    (void)registered;
+    return s;
   }
 };
 
 template <typename R, typename FwdOp, typename... FwdVs>
-constexpr bool should_enable_visit_r() {
-  if constexpr (!sizeof...(FwdVs) ||
-                (!is_variant_v<std::decay_t<FwdVs>> || ...)) {
-    return false;
-  } else {
-    constexpr should_enable_visit_r_helper<R, FwdOp, FwdVs...> helper;
+void record(size_t entry) noexcept {
+  thread_local thread_counters* local =
+      site_of<R, FwdOp, FwdVs...>::get().add_thread();
+  if (local) {
+    // Only this thread writes it.
+    auto& count = local->counts[entry];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
+}
 
-    constexpr auto for_each_scenario =
-        make_table<std::variant_size_v<std::decay_t<FwdVs>>...>(helper);
+template <typename R, typename FwdOp, typename... FwdVs>
+std::uint64_t count(size_t entry) {
+  return site_of<R, FwdOp, FwdVs...>::get().count(entry);
+}
 
-    return tools::all_of(for_each_scenario.data.begin(),
-                         for_each_scenario.data.end(),
-                         [](bool x) { return x; });
+// RFC 4180: always quoted, quotes doubled.
+inline void write_csv_field(std::ostream& os, std::string_view s) {
+  os << '"';
+  for (char c : s) {
+    if (c == '"') {
+      os << '"';
+    }
+    os << c;
   }
+  os << '"';
 }
 
-template <typename FwdOp, typename... FwdVs>
-struct visit_return_type_mapper {
-  template <size_t... idxs>
-  constexpr auto operator()(std::index_sequence<idxs...>) {
-    if constexpr ((!is_variant_v<std::decay_t<FwdVs>> || ...)) {
-      return type_t<null_t>{};
-    } else if constexpr (!std::is_invocable_v<FwdOp,
-                                              decltype(std::get<idxs>(
-                                                  std::declval<FwdVs>()))...>) {
-      return type_t<null_t>{};
+inline void write_json_string(std::ostream& os, std::string_view s) {
+  static constexpr char hex[] = "0123456789abcdef";
+  os << '"';
+  for (char c : s) {
+    auto u = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (u < 0x20) {
+      os << "\\u00" << hex[u >> 4] << hex[u & 0xf];
     } else {
-      return type_t<decltype(
-          std::declval<FwdOp>()(std::get<idxs>(std::declval<FwdVs>())...))>{};
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+// One line per entry that was hit:
+//   result,visitor,entry,alternatives,count
+inline void write_csv(std::ostream& os) {
+  os << "result,visitor,entry,alternatives,count\n";
+  for (site* s = sites.load(std::memory_order_acquire); s; s = s->next) {
+    for (size_t i = 0; i < s->size; ++i) {
+      std::uint64_t n = s->count(i);
+      if (!n) {
+        continue;
+      }
+      write_csv_field(os, s->result);
+      os << ',';
+      write_csv_field(os, s->visitor);
+      os << ',' << i << ',';
+      write_csv_field(os, s->entry_name(i));
+      os << ',' << n << '\n';
+    }
+  }
+}
+
+// [{"result": .., "visitor": .., "entries": [{"entry": 0,
+//   "alternatives": "int char", "count": 3}, ..]}, ..]
+inline void write_json(std::ostream& os) {
+  os << '[';
+  const char* site_sep = "";
+  for (site* s = sites.load(std::memory_order_acquire); s; s = s->next) {
+    os << site_sep << "{\"result\": ";
+    write_json_string(os, s->result);
+    os << ", \"visitor\": ";
+    write_json_string(os, s->visitor);
+    os << ", \"entries\": [";
+    const char* entry_sep = "";
+    for (size_t i = 0; i < s->size; ++i) {
+      std::uint64_t n = s->count(i);
+      if (!n) {
+        continue;
+      }
+      os << entry_sep << "{\"entry\": " << i << ", \"alternatives\": ";
+      write_json_string(os, s->entry_name(i));
+      os << ", \"count\": " << n << '}';
+      entry_sep = ", ";
     }
+    os << "]}";
+    site_sep = ", ";
+  }
+  os << "]\n";
+}
+
+}  // namespace instrumentation
+
+#endif  // TOOLS_VISIT_INSTRUMENTATION
+
+// Opt-in for visitors that call the same overloads whatever the value
+// category and constness of the op and the variants are: i.e. a const
+// operator() taking every alternative by const&.
+// visit(op, v), visit(op, std::as_const(v)) and visit(op, std::move(v))
+// then share one table and one set of thunks, the const& one.
+template <typename Op>
+struct visit_by_const_ref : std::false_type {};
+
+// Below, with the visit traits.
+template <typename R, typename FwdOp, typename... FwdVs>
+constexpr bool should_enable_visit_r();
+
+template <typename R, typename Strategy, typename Op, typename... Vs>
+constexpr auto visit_with_r(Strategy, Op&& op, Vs&&... vs)
+    -> std::enable_if_t<is_dispatch_strategy_v<Strategy>, R> {
+#ifdef TOOLS_VISIT_INSTRUMENTATION
+#ifdef TOOLS_VISIT_HAS_IS_CONSTANT_EVALUATED
+  if (!__builtin_is_constant_evaluated())
+#endif
+    instrumentation::record<R, decltype(std::forward<Op>(op)),
+                            decltype(std::forward<Vs>(vs))...>(
+        visit_linear_index(vs...));
+#endif
+  if constexpr (visit_by_const_ref<std::decay_t<Op>>::value) {
+    static_assert(should_enable_visit_r<R, const std::decay_t<Op>&,
+                                        const std::decay_t<Vs>&...>(),
+                  "visit_by_const_ref<Op> requires op to be callable as "
+                  "const Op& with const& alternatives, returning R");
+    return Strategy::template visit<R>(std::as_const(op), std::as_const(vs)...);
+  } else {
+    return Strategy::template visit<R>(std::forward<Op>(op),
+                                       std::forward<Vs>(vs)...);
+  }
+}
+
+// Pre-instantiated tables ------------------------------------------------
+//
+// Header, next to the variant, at global scope:
+//   namespace app {
+//   using message = std::variant<...>;
+//   struct printer { ... };
+//   }  // namespace app
+//
+//   TOOLS_VISIT_EXTERN_TABLE(int, const app::printer&, const app::message&)
+// One .cc file, at global scope too:
+//   TOOLS_VISIT_INSTANTIATE_TABLE(int, const app::printer&,
+//                                 const app::message&)
+//
+// Both macros specialize or instantiate templates of tools, which C++ only
+// allows from a namespace that encloses tools: not from inside app.
+// The types are the forwarded ones: R, then decltype(std::forward<Op>(op))
+// and decltype(std::forward<Vs>(vs))... of the visit_with_r<R> calls to
+// cover. The other translation units call the instantiated visit_extern and
+// do not build the table or the thunks. R and the op type cannot have
+// commas: use aliases.
+
+template <typename R, typename FwdOp, typename... FwdVs>
+struct extern_visit_table : std::false_type {};
+
+template <typename R, typename FwdOp, typename... FwdVs>
+R visit_extern(FwdOp op, FwdVs... vs) {
+  return visit_with_r<R>(auto_dispatch<>{}, std::forward<FwdOp>(op),
+                         std::forward<FwdVs>(vs)...);
+}
+
+#define TOOLS_VISIT_EXTERN_TABLE(R, FwdOp, ...)                   \
+  template <>                                                     \
+  struct tools::extern_visit_table<R, FwdOp, __VA_ARGS__>         \
+      : ::std::true_type {};                                      \
+  extern template R tools::visit_extern<R, FwdOp, __VA_ARGS__>(   \
+      FwdOp, __VA_ARGS__);
+
+#define TOOLS_VISIT_INSTANTIATE_TABLE(R, FwdOp, ...) \
+  template R tools::visit_extern<R, FwdOp, __VA_ARGS__>(FwdOp, __VA_ARGS__);
+
+template <typename R, typename Op, typename... Vs>
+constexpr auto visit_with_r(Op&& op, Vs&&... vs)
+    -> std::enable_if_t<!is_dispatch_strategy_v<Op>, R> {
+  if constexpr (extern_visit_table<R, decltype(std::forward<Op>(op)),
+                                   decltype(std::forward<Vs>(vs))...>::value) {
+    return visit_extern<R, decltype(std::forward<Op>(op)),
+                        decltype(std::forward<Vs>(vs))...>(
+        std::forward<Op>(op), std::forward<Vs>(vs)...);
+  } else {
+    return visit_with_r<R>(auto_dispatch<>{}, std::forward<Op>(op),
+                           std::forward<Vs>(vs)...);
   }
+}
+
+template <typename T>
+struct is_variant : std::false_type {};
+
+template <typename... Ts>
+struct is_variant<std::variant<Ts...>> : std::true_type {};
+
+template <typename T>
+constexpr bool is_variant_v = is_variant<T>::value;
+
+template <typename To>
+void convert_to(To) noexcept;
+
+// std::is_nothrow_convertible is C++20. Also true for To = void, as in
+// std::is_nothrow_invocable_r.
+template <typename From, typename To>
+constexpr bool is_nothrow_convertible() {
+  if constexpr (std::is_void_v<To>) {
+    return true;
+  } else if constexpr (!std::is_convertible_v<From, To>) {
+    return false;
+  } else {
+    return noexcept(convert_to<To>(std::declval<From>()));
+  }
+}
+
+template <typename FwdOp, typename Args, typename = void>
+struct visit_entry {
+  using type = null_t;
+  static constexpr bool nothrow = false;
+};
+
+template <typename FwdOp, typename... Args>
+struct visit_entry<FwdOp,
+                   type_list<Args...>,
+                   std::void_t<std::invoke_result_t<FwdOp, Args...>>> {
+  using type = std::invoke_result_t<FwdOp, Args...>;
+  static constexpr bool nothrow = std::is_nothrow_invocable_v<FwdOp, Args...>;
+};
+
+template <typename... Entries>
+struct visit_entries {
+  static constexpr bool invocable =
+      all_true({!std::is_same_v<typename Entries::type, null_t>...});
+
+  using result = std::conditional_t<
+      invocable,
+      decltype(common_type(type_list<typename Entries::type...>{})),
+      null_t>;
+
+  template <typename R>
+  static constexpr bool invocable_r =
+      invocable &&
+      (std::is_void_v<R> ||
+       all_true({std::is_convertible_v<typename Entries::type, R>...}));
+
+  template <typename R>
+  static constexpr bool nothrow_r =
+      invocable_r<R> &&
+      all_true({(Entries::nothrow &&
+                 is_nothrow_convertible<typename Entries::type, R>())...});
+};
+
+template <bool all_variants, typename FwdOp, typename... FwdVs>
+struct visit_traits_impl {
+  using type = visit_traits_impl;
+  using result = null_t;
+
+  template <typename R>
+  static constexpr bool invocable_r = false;
+
+  template <typename R>
+  static constexpr bool nothrow_r = false;
 };
 
 template <typename FwdOp, typename... FwdVs>
-constexpr auto visit_return_types_helper() {
-  constexpr visit_return_type_mapper<FwdOp, FwdVs...> mapper;
-  constexpr auto result_table =
-      make_type_table<std::variant_size_v<std::decay_t<FwdVs>>...>(mapper);
+struct visit_traits_impl<true, FwdOp, FwdVs...> {
+  using math = table_index_math<std::variant_size_v<std::decay_t<FwdVs>>...>;
+
+  template <size_t... idxs>
+  static auto entry(std::index_sequence<idxs...>) -> visit_entry<
+      FwdOp,
+      type_list<decltype(std::get<idxs>(std::declval<FwdVs>()))...>>;
 
-  return tools::common_type(result_table);
+  template <size_t... from0_to_n>
+  static auto entries(std::index_sequence<from0_to_n...>) -> visit_entries<
+      decltype(entry(typename math::template multi_s<from0_to_n>{}))...>;
+
+  using type = decltype(entries(std::make_index_sequence<math::size_linear>{}));
+};
+
+// Everything visit needs to know about an op and its arguments, computed
+// in one expansion over the table and shared by all the overloads:
+// result is type_t<common result> or null_t, invocable_r<R> is what
+// std::is_invocable_r_v would be for every entry.
+// The function pointers are in visit_vtable<R, FwdOp, FwdVs...>.
+template <typename FwdOp, typename... FwdVs>
+struct visit_traits
+    : visit_traits_impl<sizeof...(FwdVs) &&
+                            (is_variant_v<std::decay_t<FwdVs>> && ...),
+                        FwdOp,
+                        FwdVs...>::type {};
+
+template <typename R, typename FwdOp, typename... FwdVs>
+constexpr bool should_enable_visit_r() {
+  return visit_traits<FwdOp, FwdVs...>::template invocable_r<R>;
+}
+
+// Visit cannot throw if no overload can and there is no valueless
+// variant to throw bad_variant_access for.
+template <typename R, typename FwdOp, typename... FwdVs>
+constexpr bool is_nothrow_visit_r() {
+  if constexpr (TOOLS_VISIT_HAS_EXCEPTIONS &&
+                (valueless_slots<std::decay_t<FwdVs>> || ...)) {
+    return false;
+  } else {
+    return visit_traits<FwdOp, FwdVs...>::template nothrow_r<R>;
+  }
 }
 
 template <typename FwdOp, typename... FwdVs>
 using visit_return_type =
-    typename decltype(visit_return_types_helper<FwdOp, FwdVs...>())::type;
+    typename visit_traits<FwdOp, FwdVs...>::result::type;
 
 template <typename R, typename Op, typename... Vs>
-constexpr auto visit(Op&& op, Vs&&... vs) -> std::enable_if_t<
-    should_enable_visit_r<R,
-                          decltype(std::forward<Op>(op)),
-                          decltype(std::forward<Vs>(vs))...>(),
-    R> {
+constexpr auto visit(Op&& op, Vs&&... vs) noexcept(
+    is_nothrow_visit_r<R,
+                       decltype(std::forward<Op>(op)),
+                       decltype(std::forward<Vs>(vs))...>())
+    -> std::enable_if_t<
+        should_enable_visit_r<R,
+                              decltype(std::forward<Op>(op)),
+                              decltype(std::forward<Vs>(vs))...>(),
+        R> {
   return visit_with_r<R>(std::forward<Op>(op), std::forward<Vs>(vs)...);
 }
 
 template <typename Op, typename... Vs>
-constexpr auto visit(Op&& op, Vs&&... vs)
+constexpr auto visit(Op&& op, Vs&&... vs) noexcept(
+    is_nothrow_visit_r<visit_return_type<decltype(std::forward<Op>(op)),
+                                         decltype(std::forward<Vs>(vs))...>,
+                       decltype(std::forward<Op>(op)),
+                       decltype(std::forward<Vs>(vs))...>())
     -> visit_return_type<decltype(std::forward<Op>(op)),
                          decltype(std::forward<Vs>(vs))...> {
   using R = visit_return_type<decltype(std::forward<Op>(op)),
@@ -417,4 +1634,618 @@ constexpr auto visit(Op&& op, Vs&&... vs)
   return visit_with_r<R>(std::forward<Op>(op), std::forward<Vs>(vs)...);
 }
 
+template <typename R, typename Strategy, typename Op, typename... Vs>
+constexpr auto visit(Strategy strategy, Op&& op, Vs&&... vs) noexcept(
+    is_nothrow_visit_r<R,
+                       decltype(std::forward<Op>(op)),
+                       decltype(std::forward<Vs>(vs))...>())
+    -> std::enable_if_t<is_dispatch_strategy_v<Strategy> &&
+                            should_enable_visit_r<
+                                R,
+                                decltype(std::forward<Op>(op)),
+                                decltype(std::forward<Vs>(vs))...>(),
+                        R> {
+  return visit_with_r<R>(strategy, std::forward<Op>(op),
+                         std::forward<Vs>(vs)...);
+}
+
+template <typename Strategy, typename Op, typename... Vs>
+constexpr auto visit(Strategy strategy, Op&& op, Vs&&... vs) noexcept(
+    is_nothrow_visit_r<visit_return_type<decltype(std::forward<Op>(op)),
+                                         decltype(std::forward<Vs>(vs))...>,
+                       decltype(std::forward<Op>(op)),
+                       decltype(std::forward<Vs>(vs))...>())
+    -> visit_return_type<std::enable_if_t<is_dispatch_strategy_v<Strategy>,
+                                          decltype(std::forward<Op>(op))>,
+                         decltype(std::forward<Vs>(vs))...> {
+  using R = visit_return_type<decltype(std::forward<Op>(op)),
+                              decltype(std::forward<Vs>(vs))...>;
+  return visit_with_r<R>(strategy, std::forward<Op>(op),
+                         std::forward<Vs>(vs)...);
+}
+
+// tools::visit(likely_dispatch<likely_idxs...>{}, op, vs...)
+template <size_t... likely_idxs, typename Op, typename... Vs>
+constexpr auto visit_likely(Op&& op, Vs&&... vs) noexcept(
+    noexcept(tools::visit(likely_dispatch<likely_idxs...>{},
+                          std::forward<Op>(op),
+                          std::forward<Vs>(vs)...)))
+    -> decltype(tools::visit(likely_dispatch<likely_idxs...>{},
+                             std::forward<Op>(op),
+                             std::forward<Vs>(vs)...)) {
+  return tools::visit(likely_dispatch<likely_idxs...>{}, std::forward<Op>(op),
+                      std::forward<Vs>(vs)...);
+}
+
+// Symmetric visit --------------------------------------------------------
+//
+// For commutative visitors over two variants of the same type: only the
+// entries with i <= j exist, arguments below the diagonal are swapped.
+// That is n * (n + 1) / 2 thunks instead of n * n.
+
+// Linearizes the upper triangle of an n x n table row by row.
+template <size_t n>
+struct triangular_index_math {
+  using index_a = std::array<size_t, 2>;
+
+  static constexpr size_t size_linear = n * (n + 1) / 2;
+
+  static constexpr size_t row_start(size_t i) {
+    return i * n - i * (i - 1) / 2;
+  }
+
+  // requires: i <= j
+  static constexpr size_t as_linear(const index_a& arr) {
+    return row_start(arr[0]) + (arr[1] - arr[0]);
+  }
+
+  // Both digits of every entry, computed once for the whole table.
+  static constexpr auto rows_a = [] {
+    std::array<size_t, size_linear> res{};
+    for (size_t i = 0, idx = 0; i < n; ++i) {
+      for (size_t j = i; j < n; ++j) {
+        res[idx++] = i;
+      }
+    }
+    return res;
+  }();
+
+  static constexpr size_t column(size_t idx) {
+    return rows_a[idx] + idx - row_start(rows_a[idx]);
+  }
+
+  static constexpr index_a as_multi_a(size_t idx) {
+    return {rows_a[idx], column(idx)};
+  }
+
+  // No function to instantiate and no loop to run per entry.
+  template <size_t idx>
+  using multi_s = std::index_sequence<rows_a[idx], column(idx)>;
+
+  template <size_t idx>
+  static constexpr auto as_multi_s() {
+    return multi_s<idx>{};
+  }
+};
+
+template <typename R, typename FwdOp, typename FwdV, size_t... from0_to_n>
+constexpr auto make_symmetric_vtable(std::index_sequence<from0_to_n...>) {
+  using math = triangular_index_math<dispatch_size<std::decay_t<FwdV>>>;
+  constexpr visit_vtable_generator<R, FwdOp, FwdV, FwdV> generator;
+
+  return std::array<R (*)(FwdOp, FwdV, FwdV), sizeof...(from0_to_n)>{
+      generator(typename math::template multi_s<from0_to_n>{})...};
+}
+
+template <typename R, typename FwdOp, typename FwdV>
+alignas(cache_line_size) inline constexpr auto symmetric_vtable =
+    make_symmetric_vtable<R, FwdOp, FwdV>(std::make_index_sequence<
+        triangular_index_math<
+            dispatch_size<std::decay_t<FwdV>>>::size_linear>{});
+
+// Both variants go through one table, so they are passed the same way:
+// as they are if they already are, as const V& otherwise. No type for
+// two different variants, so that visit_symmetric is not a candidate.
+template <typename FwdV1, typename FwdV2, typename = void>
+struct symmetric_forward {};
+
+template <typename FwdV1, typename FwdV2>
+constexpr bool same_variant_v =
+    std::is_same_v<std::decay_t<FwdV1>, std::decay_t<FwdV2>>;
+
+template <typename FwdV1, typename FwdV2>
+struct symmetric_forward<FwdV1,
+                         FwdV2,
+                         std::enable_if_t<same_variant_v<FwdV1, FwdV2>>> {
+  using type = std::conditional_t<std::is_same_v<FwdV1, FwdV2>,
+                                  FwdV1,
+                                  const std::decay_t<FwdV1>&>;
+};
+
+template <typename FwdV1, typename FwdV2>
+using symmetric_forward_t = typename symmetric_forward<FwdV1, FwdV2>::type;
+
+template <typename R, typename Op, typename V1, typename V2>
+constexpr auto visit_symmetric_with_r(Op&& op, V1&& a, V2&& b)
+    -> std::enable_if_t<std::is_reference_v<symmetric_forward_t<V1&&, V2&&>>,
+                        R> {
+  using FwdV = symmetric_forward_t<V1&&, V2&&>;
+
+  constexpr size_t n = dispatch_size<std::decay_t<FwdV>>;
+  constexpr auto& vtable =
+      symmetric_vtable<R, decltype(std::forward<Op>(op)), FwdV>;
+
+  const size_t a_idx = slot_index(a);
+  const size_t b_idx = slot_index(b);
+  const bool swap = a_idx > b_idx;
+  size_t i = swap ? b_idx : a_idx;
+  size_t j = swap ? a_idx : b_idx;
+
+  size_t idx = triangular_index_math<n>::as_linear({i, j});
+
+  return swap ? vtable[idx](std::forward<Op>(op), static_cast<FwdV>(b),
+                            static_cast<FwdV>(a))
+              : vtable[idx](std::forward<Op>(op), static_cast<FwdV>(a),
+                            static_cast<FwdV>(b));
+}
+
+template <typename FwdOp, typename FwdV, size_t i, size_t j>
+auto symmetric_result(std::index_sequence<i, j>) -> type_t<decltype(
+    std::declval<FwdOp>()(std::get<i>(std::declval<FwdV>()),
+                          std::get<j>(std::declval<FwdV>())))>;
+
+template <typename FwdOp, typename FwdV, size_t... from0_to_n>
+constexpr auto symmetric_return_types_helper(
+    std::index_sequence<from0_to_n...>) {
+  using math = triangular_index_math<std::variant_size_v<std::decay_t<FwdV>>>;
+  return tools::common_type(
+      type_list<typename decltype(symmetric_result<FwdOp, FwdV>(
+          typename math::template multi_s<from0_to_n>{}))::type...>{});
+}
+
+template <typename FwdOp, typename FwdV>
+using symmetric_return_type =
+    typename decltype(symmetric_return_types_helper<FwdOp, FwdV>(
+        std::make_index_sequence<triangular_index_math<
+            std::variant_size_v<std::decay_t<FwdV>>>::size_linear>{}))::type;
+
+template <typename Op, typename V1, typename V2>
+constexpr auto visit_symmetric(Op&& op, V1&& a, V2&& b)
+    -> symmetric_return_type<decltype(std::forward<Op>(op)),
+                             symmetric_forward_t<V1&&, V2&&>> {
+  using R = symmetric_return_type<decltype(std::forward<Op>(op)),
+                                  symmetric_forward_t<V1&&, V2&&>>;
+  return visit_symmetric_with_r<R>(std::forward<Op>(op), std::forward<V1>(a),
+                                   std::forward<V2>(b));
+}
+
+// Runtime indices to template arguments ----------------------------------
+//
+// The table behind visit, for any runtime indices:
+//   dispatch_index<3, 2>(op, i, j) calls op(std::index_sequence<i, j>{})
+// with one indirect call. op returns the same type for all of them.
+// Enums with a count and bools are passed as is: op gets an
+// std::integral_constant of the enum or std::bool_constant for each:
+//   dispatch_index([&](auto width, auto aligned) {
+//     kernel<width(), aligned()>(data);
+//   }, simd_width::avx2, is_aligned);
+
+template <typename R, typename FwdOp>
+struct dispatch_index_generator {
+  using vtable_element = R (*)(FwdOp);
+
+  template <size_t... idxs>
+  constexpr vtable_element operator()(std::index_sequence<idxs...>) const {
+    return [](FwdOp op) -> R {
+      return std::forward<FwdOp>(op)(std::index_sequence<idxs...>{});
+    };
+  }
+};
+
+template <typename R, typename FwdOp, size_t... dims>
+alignas(cache_line_size) inline constexpr auto dispatch_index_vtable =
+    make_table<dims...>(dispatch_index_generator<R, FwdOp>{});
+
+// The check comes before the return type: op might not be SFINAE friendly
+// for the index_sequence<> of a call to the overload below.
+template <size_t... dims,
+          typename Op,
+          typename... Is,
+          typename = std::enable_if_t<sizeof...(dims) != 0 &&
+                                      sizeof...(dims) == sizeof...(Is)>>
+constexpr auto dispatch_index(Op&& op, Is... is)
+    -> decltype(std::forward<Op>(op)(std::index_sequence<(dims - dims)...>{})) {
+  using R =
+      decltype(std::forward<Op>(op)(std::index_sequence<(dims - dims)...>{}));
+  constexpr auto& vtable =
+      dispatch_index_vtable<R, decltype(std::forward<Op>(op)), dims...>;
+
+  assert(all_true({static_cast<size_t>(is) < dims...}));
+  return vtable[{static_cast<size_t>(is)...}](std::forward<Op>(op));
+}
+
+// Opt-in for enums that do not have a count enumerator.
+template <typename E, typename = void>
+struct enum_size {};
+
+template <typename E>
+struct enum_size<E, std::enable_if_t<std::is_enum_v<E>,
+                                     std::void_t<decltype(E::count)>>>
+    : std::integral_constant<size_t, static_cast<size_t>(E::count)> {};
+
+template <typename T, typename = void>
+struct index_count {};
+
+template <>
+struct index_count<bool> : std::integral_constant<size_t, 2> {};
+
+template <typename E>
+struct index_count<E, std::void_t<decltype(enum_size<E>::value)>>
+    : enum_size<E> {};
+
+template <typename T, typename = void>
+constexpr bool has_index_count_v = false;
+
+template <typename T>
+constexpr bool
+    has_index_count_v<T, std::void_t<decltype(index_count<T>::value)>> = true;
+
+template <typename Op, typename... Ts>
+struct dispatch_index_as_constants {
+  Op& op;
+
+  template <size_t... idxs>
+  constexpr decltype(auto) operator()(std::index_sequence<idxs...>) const {
+    return std::forward<Op>(op)(
+        std::integral_constant<Ts, static_cast<Ts>(idxs)>{}...);
+  }
+};
+
+template <typename Op, typename... Ts>
+constexpr auto dispatch_index(Op&& op, Ts... xs)
+    -> std::enable_if_t<sizeof...(Ts) != 0 && (has_index_count_v<Ts> && ...),
+                        decltype(std::forward<Op>(op)(
+                            std::integral_constant<Ts, Ts{}>{}...))> {
+  return dispatch_index<index_count<Ts>::value...>(
+      dispatch_index_as_constants<Op, Ts...>{op}, xs...);
+}
+
+// Batch visit ------------------------------------------------------------
+//
+// visit_range(op, first, last, firsts...) is
+//   for (; first != last; ++first, ++firsts...) visit(op, *first, *firsts...);
+// without the results, but it reads the indices ahead and makes one
+// indirect call per run of the same alternatives: the run is a tight loop
+// with op inlined, instead of one unpredictable call per element.
+
+#ifndef TOOLS_VISIT_PREFETCH_DISTANCE
+#define TOOLS_VISIT_PREFETCH_DISTANCE 16
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TOOLS_VISIT_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define TOOLS_VISIT_PREFETCH(addr) ((void)(addr))
+#endif
+
+// Opt-in for visitors that can be called on the elements in any order:
+// visit_range over random access ranges then groups all the elements with
+// the same alternatives first, a counting sort by linear index, and makes
+// one run per combination.
+template <typename Op>
+struct visit_order_independent : std::false_type {};
+
+template <typename I>
+using iterator_variant_t =
+    std::decay_t<typename std::iterator_traits<I>::reference>;
+
+template <typename... Is>
+constexpr bool all_random_access_v =
+    (std::is_base_of_v<std::random_access_iterator_tag,
+                       typename std::iterator_traits<Is>::iterator_category> &&
+     ...);
+
+// Proxy and move iterators have no element address to prefetch.
+template <typename I>
+constexpr bool prefetchable_v =
+    all_random_access_v<I> &&
+    std::is_lvalue_reference_v<typename std::iterator_traits<I>::reference>;
+
+template <typename I>
+void visit_range_prefetch(const I& it, const I& last) {
+  if constexpr (prefetchable_v<I>) {
+    if (last - it > TOOLS_VISIT_PREFETCH_DISTANCE) {
+      TOOLS_VISIT_PREFETCH(std::addressof(it[TOOLS_VISIT_PREFETCH_DISTANCE]));
+    }
+  }
+}
+
+template <typename Op, typename I, typename... Is>
+struct visit_range_generator {
+  using run_element = void (*)(Op&, I&, const I&, Is&...);
+  using gather_element =
+      void (*)(Op&, const size_t*, const size_t*, const I&, const Is&...);
+
+  template <size_t d, size_t... ds>
+  static constexpr bool is_valueless(std::index_sequence<d, ds...>) {
+    return d < valueless_slots<iterator_variant_t<I>> ||
+           ((ds < valueless_slots<iterator_variant_t<Is>>) || ...);
+  }
+
+  template <size_t d, size_t... ds, typename FwdV, typename... FwdVs>
+  static void call(Op& op, FwdV&& v, FwdVs&&... vs) {
+    op(unchecked_get<d - valueless_slots<std::decay_t<FwdV>>>(
+           std::forward<FwdV>(v)),
+       unchecked_get<ds - valueless_slots<std::decay_t<FwdVs>>>(
+           std::forward<FwdVs>(vs))...);
+  }
+
+  // From first on, as long as the dispatch indices are still d, ds...:
+  // one loop with op inlined, and a predictable exit.
+  template <size_t d, size_t... ds>
+  static void run(Op& op, I& first, const I& last, Is&... firsts) {
+    if constexpr (is_valueless(std::index_sequence<d, ds...>{})) {
+      throw_bad_variant_access();
+    } else {
+      do {
+        visit_range_prefetch(first, last);
+        call<d, ds...>(op, *first, *firsts...);
+        ++first;
+        (++firsts, ...);
+      } while (first != last && slot_index(*first) == d &&
+               ((slot_index(*firsts) == ds) && ...));
+    }
+  }
+
+  // The elements at the offsets [f, l).
+  template <size_t d, size_t... ds>
+  static void gather(Op& op,
+                     const size_t* f,
+                     const size_t* l,
+                     const I& first,
+                     const Is&... firsts) {
+    if constexpr (is_valueless(std::index_sequence<d, ds...>{})) {
+      throw_bad_variant_access();
+    } else {
+      for (; f != l; ++f) {
+        if constexpr (prefetchable_v<I>) {
+          if (l - f > TOOLS_VISIT_PREFETCH_DISTANCE) {
+            TOOLS_VISIT_PREFETCH(
+                std::addressof(first[f[TOOLS_VISIT_PREFETCH_DISTANCE]]));
+          }
+        }
+        call<d, ds...>(op, first[*f], firsts[*f]...);
+      }
+    }
+  }
+
+  struct runs {
+    template <size_t... ds>
+    constexpr run_element operator()(std::index_sequence<ds...>) const {
+      return &run<ds...>;
+    }
+  };
+
+  struct gathers {
+    template <size_t... ds>
+    constexpr gather_element operator()(std::index_sequence<ds...>) const {
+      return &gather<ds...>;
+    }
+  };
+};
+
+template <typename Op, typename I, typename... Is>
+inline constexpr auto visit_range_runs =
+    make_table<dispatch_size<iterator_variant_t<I>>,
+               dispatch_size<iterator_variant_t<Is>>...>(
+        typename visit_range_generator<Op, I, Is...>::runs{});
+
+template <typename Op, typename I, typename... Is>
+inline constexpr auto visit_range_gathers =
+    make_table<dispatch_size<iterator_variant_t<I>>,
+               dispatch_size<iterator_variant_t<Is>>...>(
+        typename visit_range_generator<Op, I, Is...>::gathers{});
+
+template <typename I, typename... Is>
+size_t visit_range_index(const I& it, const Is&... its) {
+  return visit_index_math<iterator_variant_t<I>, iterator_variant_t<Is>...>::
+      as_linear({slot_index(*it), slot_index(*its)...});
+}
+
+template <typename Runs, typename Op, typename I, typename... Is>
+void visit_range_in_order(const Runs& runs,
+                          Op& op,
+                          I first,
+                          I last,
+                          Is... firsts) {
+  while (first != last) {
+    runs.data[visit_range_index(first, firsts...)](op, first, last,
+                                                   firsts...);
+  }
+}
+
+template <typename Op, typename I, typename... Is>
+void visit_range_by_index(Op& op, I first, I last, Is... firsts) {
+  constexpr auto& gathers = visit_range_gathers<Op, I, Is...>;
+  constexpr size_t size_linear = gathers.size_linear;
+
+  const size_t size = static_cast<size_t>(last - first);
+  std::vector<size_t> idxs(size);
+  std::vector<size_t> starts(size_linear + 1);
+  for (size_t i = 0; i < size; ++i) {
+    idxs[i] = visit_range_index(first + i, (firsts + i)...);
+    ++starts[idxs[i] + 1];
+  }
+  std::partial_sum(starts.begin(), starts.end(), starts.begin());
+
+  // Stable: the elements of one run stay in their order.
+  std::vector<size_t> order(size);
+  std::vector<size_t> next(starts.begin(), starts.end() - 1);
+  for (size_t i = 0; i < size; ++i) {
+    order[next[idxs[i]]++] = i;
+  }
+
+  for (size_t idx = 0; idx < size_linear; ++idx) {
+    if (starts[idx] != starts[idx + 1]) {
+      gathers.data[idx](op, order.data() + starts[idx],
+                        order.data() + starts[idx + 1], first, firsts...);
+    }
+  }
+}
+
+template <typename Op, typename I, typename... Is>
+void visit_range(Op&& op, I first, I last, Is... firsts) {
+  using op_t = std::remove_reference_t<Op>;
+  if constexpr (visit_order_independent<std::decay_t<Op>>::value &&
+                all_random_access_v<I, Is...>) {
+    visit_range_by_index<op_t>(op, first, last, firsts...);
+  } else {
+    visit_range_in_order(visit_range_runs<op_t, I, Is...>, op, first, last,
+                         firsts...);
+  }
+}
+
+#ifdef __cpp_lib_span
+template <typename T>
+using span = std::span<T>;
+#else
+// The part of C++20 std::span that visit_spans needs.
+template <typename T>
+class span {
+ public:
+  constexpr span(T* data, size_t size) : data_(data), size_(size) {}
+
+  constexpr T* data() const { return data_; }
+  constexpr size_t size() const { return size_; }
+  constexpr bool empty() const { return !size_; }
+  constexpr T* begin() const { return data_; }
+  constexpr T* end() const { return data_ + size_; }
+  constexpr T& operator[](size_t i) const { return data_[i]; }
+
+ private:
+  T* data_;
+  size_t size_;
+};
+#endif
+
+#ifndef TOOLS_VISIT_SPAN_SIZE
+#define TOOLS_VISIT_SPAN_SIZE 64
+#endif
+
+// The parameter of a single, non-template operator(), void otherwise.
+// Never instantiates the body of a generic one.
+template <typename M>
+struct member_parameter {
+  using type = void;
+};
+
+template <typename R, typename C, typename A>
+struct member_parameter<R (C::*)(A)> {
+  using type = std::remove_cv_t<std::remove_reference_t<A>>;
+};
+
+template <typename R, typename C, typename A>
+struct member_parameter<R (C::*)(A) const> : member_parameter<R (C::*)(A)> {};
+
+template <typename R, typename C, typename A>
+struct member_parameter<R (C::*)(A) noexcept>
+    : member_parameter<R (C::*)(A)> {};
+
+template <typename R, typename C, typename A>
+struct member_parameter<R (C::*)(A) const noexcept>
+    : member_parameter<R (C::*)(A)> {};
+
+template <typename F, typename = void>
+struct call_parameter {
+  using type = void;
+};
+
+template <typename F>
+struct call_parameter<F, std::void_t<decltype(&F::operator())>>
+    : member_parameter<decltype(&F::operator())> {};
+
+// Whether visit_spans passes the runs of T to op as span<const T>. Only
+// for an operator() that names the span: a non-template one, alone or as
+// one of the lambdas of an overload. Visitors with several operator() can
+// opt in by specializing it.
+template <typename Op, typename T>
+struct takes_spans
+    : std::is_same<typename call_parameter<Op>::type, span<const T>> {};
+
+template <typename... Fs, typename T>
+struct takes_spans<overload<Fs...>, T>
+    : std::disjunction<takes_spans<Fs, T>...> {};
+
+// Runs of a trivial alternative T that op takes_spans of are
+// copied into a buffer, TOOLS_VISIT_SPAN_SIZE elements at a time, and
+// passed as spans. Any other run is visited one element at a time.
+template <typename Op, typename I>
+struct visit_spans_generator : visit_range_generator<Op, I> {
+  using base = visit_range_generator<Op, I>;
+  using V = iterator_variant_t<I>;
+
+  template <size_t d>
+  using alternative_t = std::variant_alternative_t<d - valueless_slots<V>, V>;
+
+  template <size_t d>
+  static constexpr bool takes_span() {
+    if constexpr (d < valueless_slots<V>) {
+      return false;
+    } else {
+      return std::is_trivial_v<alternative_t<d>> &&
+             takes_spans<std::remove_const_t<Op>, alternative_t<d>>::value;
+    }
+  }
+
+  template <size_t d>
+  static void run(Op& op, I& first, const I& last) {
+    using T = alternative_t<d>;
+    T buffer[TOOLS_VISIT_SPAN_SIZE];
+    size_t n = 0;
+    do {
+      visit_range_prefetch(first, last);
+      buffer[n++] = unchecked_get<d - valueless_slots<V>>(*first);
+      ++first;
+      if (n == TOOLS_VISIT_SPAN_SIZE) {
+        op(span<const T>(buffer, n));
+        n = 0;
+      }
+    } while (first != last && slot_index(*first) == d);
+
+    if (n) {
+      op(span<const T>(buffer, n));
+    }
+  }
+
+  struct runs {
+    template <size_t d>
+    constexpr typename base::run_element operator()(
+        std::index_sequence<d>) const {
+      if constexpr (takes_span<d>()) {
+        return &run<d>;
+      } else {
+        return &base::template run<d>;
+      }
+    }
+  };
+};
+
+template <typename Op, typename I>
+inline constexpr auto visit_spans_runs =
+    make_table<dispatch_size<iterator_variant_t<I>>>(
+        typename visit_spans_generator<Op, I>::runs{});
+
+// visit_range(op, first, last), but op can take the runs of numeric
+// alternatives as spans and vectorize:
+//   visit_spans(overload{[](span<const double> xs) { ... },
+//                        [](span<const std::int64_t> xs) { ... },
+//                        [](null_t) { ... }},
+//               column.begin(), column.end());
+// A generic overload, i.e. [](auto x), gets the elements one by one.
+template <typename Op, typename I>
+void visit_spans(Op&& op, I first, I last) {
+  using op_t = std::remove_reference_t<Op>;
+  visit_range_in_order(visit_spans_runs<op_t, I>, op, first, last);
+}
+
 }  // namespace tools
\ No newline at end of file
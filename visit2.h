@@ -61,10 +61,25 @@ struct type_list : _type_list_impl<std::index_sequence_for<Ts...>, Ts...> {
   static constexpr std::size_t size() { return sizeof...(Ts); }
 };
 
+#if defined(__has_builtin)
+#if __has_builtin(__type_pack_element)
+#define V2_TOOLS_HAS_TYPE_PACK_ELEMENT
+#endif
+#endif
+
+#ifdef V2_TOOLS_HAS_TYPE_PACK_ELEMENT
+// O(1), no overload resolution against every base.
+template <size_t idx, typename... Ts>
+constexpr type_<__type_pack_element<idx, Ts...>> _get_success(
+    const type_list<Ts...>&) {
+  return {};
+}
+#else
 template <size_t idx, typename T>
 constexpr type_<T> _get_success(const _indexed_type<idx, T>&) {
   return {};
 }
+#endif
 
 template <size_t idx, typename Where>
 struct index_is_out_of_bounds : error_base {};
@@ -75,7 +90,7 @@ constexpr auto get(type_list<Ts...>) {
   if constexpr (idx < t.size()) {
     return _get_success<idx>(t);
   } else {
-    return index_is_out_of_bounds<idx, decltype(t)>{};
+    return index_is_out_of_bounds<idx, type_list<Ts...>>{};
   }
 }
 
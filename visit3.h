@@ -1,8 +1,10 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <type_traits>
 #include <utility>
+#include <variant>
 
 namespace v3 {
 
@@ -14,6 +16,9 @@ template <size_t s> using make_idxs_ = std::make_index_sequence<s>;
 struct error {};
 
 template <size_t... dims> struct index_conversions {
+  static constexpr size_t size = (dims * ...);
+  static constexpr std::array<size_t, sizeof...(dims)> dims_a = {dims...};
+
   static constexpr auto pows = [] {
     std::array dims_a = {dims...};
     std::array res = dims_a;
@@ -30,41 +35,30 @@ template <size_t... dims> struct index_conversions {
     return res;
   }
 
+  // Plain arithmetic per digit: nothing is instantiated or evaluated per
+  // entry besides the index sequence itself.
   template <size_t idx, size_t... for0_n>
-  static constexpr auto _multi(idxs_<for0_n...>) {
-    constexpr auto as_array = [] {
-      auto res = pows;
-      for (size_t _idx = idx, i = 0; i < pows.size(); ++i) {
-        res[i] = _idx / pows[i];
-        _idx %= pows[i];
-      }
-      return res;
-    }();
-    return idxs_<as_array[for0_n]...>{};
-  }
-
-  template <size_t idx> static constexpr auto multi() {
-    return _multi<idx>(make_idxs_<pows.size()>{});
-  };
-};
-
-template <class Fop, class ...Fvs
-
-template <class R, class Fop, class... Fvs> struct _visit_r_impl {
-  using vtable_entry = R (*)(Fop, Fvs...);
+  static constexpr auto _multi(idxs_<for0_n...>)
+      -> idxs_<idx / pows[for0_n] % dims_a[for0_n]...>;
 
+  template <size_t idx>
+  using multi_t = decltype(_multi<idx>(make_idxs_<sizeof...(dims)>{}));
 
-  template <size_t... idxs> struct vtable_generator {
-    constexpr vtable_entry operator()(idxs_<idxs...>) {
-      return [](Fop op, Fvs... vs) -> R { return Fwd(op)(Fwd(vs)...); };
-    }
-  };
+  template <size_t idx> static constexpr auto multi() { return multi_t<idx>{}; }
 };
 
 template <class T> struct type_ { using type = T; };
 
 template <class... Ts> struct types {};
 
+template <class T, class... Ts>
+constexpr bool all_same_v = [] {
+  bool same[] = {true, std::is_same_v<T, Ts>...};
+  for (bool x : same)
+    if (!x) return false;
+  return true;
+}();
+
 template <class... Ts> auto make_types() {
   if constexpr ((std::is_same_v<error, Ts> || ...))
     return error{};
@@ -72,26 +66,89 @@ template <class... Ts> auto make_types() {
     return types<Ts...>{};
 }
 
-template <class Fop, class ...Fws>
-auto all_return_types() {
-  constexpr index_conversions<
-  std::variant_size_v<std::decay<Fws>
+template <class T> struct is_variant : std::false_type {};
+template <class... Ts>
+struct is_variant<std::variant<Ts...>> : std::true_type {};
+
+template <class... Fvs>
+using conversions_for =
+    index_conversions<std::variant_size_v<std::decay_t<Fvs>>...>;
+
+// One instantiation per table entry.
+template <class Fop, class... Fvs, size_t... idxs>
+auto _return_type(idxs_<idxs...>)
+    -> decltype(std::declval<Fop>()(std::get<idxs>(std::declval<Fvs>())...));
+
+template <class Fop, class... Fvs>
+error _return_type(...);
+
+template <class Fop, class... Fvs, size_t... for0_n>
+auto _all_return_types(idxs_<for0_n...>) {
+  using conv = conversions_for<Fvs...>;
+  return make_types<decltype(_return_type<Fop, Fvs...>(
+      typename conv::template multi_t<for0_n>{}))...>();
+}
+
+template <class Fop, class... Fvs> auto all_return_types() {
+  if constexpr (!sizeof...(Fvs) ||
+                !(is_variant<std::decay_t<Fvs>>::value && ...))
+    return error{};
+  else
+    return _all_return_types<Fop, Fvs...>(
+        make_idxs_<conversions_for<Fvs...>::size>{});
 }
 
 template <class... Ts> type_<std::common_type_t<Ts...>> _common(types<Ts...>);
 error _common(...);
 
-template <typename...> using visit_rt = void;
+// Visitors mostly return one type: no std::common_type recursion then.
+template <class T, class... Ts> auto common(types<T, Ts...> ts) {
+  if constexpr (all_same_v<T, Ts...>)
+    return type_<std::decay_t<T>>{};
+  else
+    return decltype(_common(ts)){};
+}
+inline error common(error) { return {}; }
+
+template <class Fop, class... Fvs>
+using visit_rt =
+    typename decltype(common(all_return_types<Fop, Fvs...>()))::type;
+
+template <class R, class Fop, class... Fvs> struct _visit_r_impl {
+  using vtable_entry = R (*)(Fop, Fvs...);
+  using conv = conversions_for<Fvs...>;
+
+  template <size_t... idxs>
+  static constexpr R thunk(Fop op, Fvs... vs) {
+    return FWD(op)(std::get<idxs>(FWD(vs))...);
+  }
+
+  template <size_t... idxs>
+  static constexpr vtable_entry entry(idxs_<idxs...>) {
+    return &thunk<idxs...>;
+  }
+
+  template <size_t... for0_n>
+  static constexpr auto make_vtable(idxs_<for0_n...>) {
+    return std::array<vtable_entry, conv::size>{
+        entry(typename conv::template multi_t<for0_n>{})...};
+  }
+
+  static constexpr auto vtable = make_vtable(make_idxs_<conv::size>{});
+};
 
-template <class F, class... Vs> constexpr auto _visit(F&& f, Vs&&... vs) {
-  return 0;
+template <class R, class F, class... Vs>
+constexpr R visit_r(F&& f, Vs&&... vs) {
+  using impl = _visit_r_impl<R, decltype(FWD(f)), decltype(FWD(vs))...>;
+  if ((vs.valueless_by_exception() || ...)) throw std::bad_variant_access{};
+  return impl::vtable[impl::conv::linear({vs.index()...})](FWD(f), FWD(vs)...);
 }
 
 template <class F, class... Vs>
-constexpr auto visit(F&& f, Vs&&... vs) -> std::enable_if_t<
-    !std::is_same_v<error, decltype(_visit(FWD(f), FWD(vs)...))>,
-    decltype(_visit(FWD(f), FWD(vs)...))> {
-  return _visit(FWD(f), FWD(vs)...);
+constexpr auto visit(F&& f, Vs&&... vs)
+    -> visit_rt<decltype(FWD(f)), decltype(FWD(vs))...> {
+  using R = visit_rt<decltype(FWD(f)), decltype(FWD(vs))...>;
+  return visit_r<R>(FWD(f), FWD(vs)...);
 }
 
 #undef FWD
@@ -1,5 +1,7 @@
 #include "visit3.h"
 
+#include <string>
+
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
@@ -14,7 +16,63 @@ TEST_CASE("visit3.make_type_list") {
   is_same_test(make_types<int, char, error>(), error{});
 }
 
-TEST_CASE("From the bottom") { visit(0, 1, 2); }
+template <typename F, typename... Vs>
+constexpr auto is_visitable(F&& f, Vs&&... vs)
+    -> decltype(v3::visit(std::forward<F>(f), std::forward<Vs>(vs)...),
+                true) {
+  return true;
+}
+constexpr bool is_visitable(...) { return false; }
+
+struct sum_op {
+  template <typename... Ts> constexpr auto operator()(Ts... xs) const {
+    return (0 + ... + xs);
+  }
+};
+
+TEST_CASE("visit3.visit") {
+  using v_t = std::variant<int, char>;
+
+  static_assert(!is_visitable(0, 1, 2));
+  static_assert(!is_visitable([](std::string) {}, v_t{}));
+
+  static_assert(v3::visit(sum_op{}, v_t{1}) == 1);
+  static_assert(v3::visit(sum_op{}, v_t{1}, v_t{char(2)}, v_t{3}) == 6);
+  is_same_test(v3::visit(sum_op{}, v_t{}), 0);
+
+  // Different result types go through std::common_type.
+  auto widen = [](auto x) { return x; };
+  is_same_test(v3::visit(widen, std::variant<char, long>{char(1)}), long{});
+
+  std::variant<int, std::string> v{"abc"};
+  v3::visit([](auto& x) { x = std::decay_t<decltype(x)>{}; }, v);
+  REQUIRE(std::get<std::string>(v).empty());
+
+  std::string moved = v3::visit(
+      [](auto&& x) -> std::string {
+        if constexpr (std::is_same_v<decltype(x), std::string&&>)
+          return std::move(x);
+        else
+          return {};
+      },
+      std::variant<int, std::string>{"xyz"});
+  REQUIRE(moved == "xyz");
+}
+
+TEST_CASE("visit3.visit, valueless") {
+  struct throws {
+    throws() = default;
+    throws(const throws&) { throw 0; }
+    throws& operator=(const throws&) = default;
+  };
+  std::variant<int, throws> v;
+  try {
+    v = throws{};
+  } catch (int) {
+  }
+  REQUIRE(v.valueless_by_exception());
+  REQUIRE_THROWS_AS(v3::visit([](const auto&) {}, v), std::bad_variant_access);
+}
 
 template <size_t... idxs> constexpr auto to_array(idxs_<idxs...>) {
   return std::array{idxs...};
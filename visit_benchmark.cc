@@ -0,0 +1,624 @@
+#include "visit.h"
+#include "visit3.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Dispatch cost of every visit in visit.h and visit3.h against std::visit.
+//
+// One line per case:
+//   impl,arity,alternatives,visitor,distribution,min_ns,median_ns,table_bytes
+// min_ns and median_ns are per dispatch, over --repetitions samples of at
+// least --min-time-ms each. Compare the min: it is the least disturbed by
+// the rest of the machine. table_bytes is the static data used for
+// dispatch, 0 when the dispatch is code only and - when it is not known
+// (std::visit).
+//
+// --filter runs only the cases whose line starts with its argument, i.e.
+// --filter flat_table,3,4,trivial,uniform. It can be repeated: compare
+// implementations within one run, the machine drifts between runs.
+// --smoke runs every case once, for ctest.
+
+namespace bench {
+
+template <size_t i>
+struct alt {
+  static constexpr std::uint64_t index = i;
+  std::uint32_t value;
+};
+
+template <size_t... idxs>
+auto make_variant(std::index_sequence<idxs...>) -> std::variant<alt<idxs>...>;
+
+template <size_t n>
+using variant_n = decltype(make_variant(std::make_index_sequence<n>{}));
+
+template <size_t, typename T>
+using repeat = T;
+
+template <typename T>
+inline void do_not_optimize(const T& x) {
+  asm volatile("" : : "r,m"(x) : "memory");
+}
+
+// Visitors ---------------------------------------------------------------
+
+struct trivial_op {
+  static constexpr const char* name = "trivial";
+
+  template <typename... Ts>
+  std::uint64_t operator()(const Ts&... xs) const {
+    return (std::uint64_t{0} + ... + (xs.value + Ts::index));
+  }
+};
+
+struct heavy_op {
+  static constexpr const char* name = "heavy";
+
+  template <typename... Ts>
+  std::uint64_t operator()(const Ts&... xs) const {
+    std::uint64_t h = (std::uint64_t{0} ^ ... ^ (xs.value + Ts::index));
+    for (int i = 0; i < 32; ++i) {
+      h = h * 6364136223846793005u + 1442695040888963407u;
+    }
+    return h;
+  }
+};
+
+// Implementations --------------------------------------------------------
+
+struct std_visit {
+  static constexpr const char* name = "std::visit";
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = true;
+
+  template <typename Op, typename... Vs>
+  static std::uint64_t run(const Op& op, const Vs&... vs) {
+    return std::visit(op, vs...);
+  }
+
+  template <typename Op, typename... Vs>
+  static long table_bytes() {
+    return -1;
+  }
+};
+
+struct simplified_visit {
+  static constexpr const char* name = "simplified::visit";
+
+  // Single variant, void visitor only.
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = sizeof...(Vs) == 1;
+
+  template <typename Op, typename V>
+  struct accumulate {
+    const Op* op;
+    std::uint64_t* sum;
+
+    template <typename T>
+    void operator()(const T& x) const {
+      *sum += (*op)(x);
+    }
+  };
+
+  template <typename Op, typename V>
+  static std::uint64_t run(const Op& op, const V& v) {
+    std::uint64_t sum = 0;
+    tools::simplified::visit(accumulate<Op, V>{&op, &sum}, v);
+    return sum;
+  }
+
+  template <typename Op, typename... Ts>
+  static long table_bytes_helper(const std::variant<Ts...>*) {
+    return sizeof(tools::simplified::vtable<accumulate<Op, std::variant<Ts...>>,
+                                            Ts...>);
+  }
+
+  template <typename Op, typename V>
+  static long table_bytes() {
+    return table_bytes_helper<Op>(static_cast<const V*>(nullptr));
+  }
+};
+
+struct visit_with_r_simplified {
+  static constexpr const char* name = "visit_with_r_simplified";
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = true;
+
+  template <typename Op, typename... Vs>
+  static std::uint64_t run(const Op& op, const Vs&... vs) {
+    return tools::visit_with_r_simplified<std::uint64_t>(op, vs...);
+  }
+
+  template <typename Op, typename... Vs>
+  static long table_bytes() {
+    return sizeof(tools::visit_vtable<std::uint64_t, const Op&, const Vs&...>);
+  }
+};
+
+template <typename Op, typename... Vs>
+long strategy_table_bytes(tools::flat_table_dispatch) {
+  return sizeof(tools::visit_vtable<std::uint64_t, const Op&, const Vs&...>);
+}
+
+template <typename Op, typename... Vs>
+long strategy_table_bytes(tools::compressed_table_dispatch) {
+  return tools::compressed_vtable<std::uint64_t, const Op&,
+                                  const Vs&...>::compressed_bytes;
+}
+
+// One table per visited prefix, except for the last variant.
+template <typename Op, typename... Vs>
+long strategy_table_bytes(tools::nested_dispatch) {
+  constexpr size_t sizes[] = {tools::dispatch_size<Vs>...};
+  long res = 0;
+  long tables = 1;
+  for (size_t i = 0; i + 1 < sizeof...(Vs); ++i) {
+    res += tables * sizes[i] * sizeof(void*);
+    tables *= sizes[i];
+  }
+  return res;
+}
+
+template <typename Op, typename... Vs>
+long strategy_table_bytes(tools::padded_table_dispatch) {
+  return sizeof(
+      tools::padded_visit_vtable<std::uint64_t, const Op&, const Vs&...>);
+}
+
+template <typename Op, typename... Vs>
+long strategy_table_bytes(tools::dispatch_strategy) {
+  return 0;
+}
+
+template <typename Op, typename... Vs>
+long auto_dispatch_table_bytes() {
+  return strategy_table_bytes<Op, Vs...>(
+      tools::auto_dispatch<>::select<Vs...>());
+}
+
+struct visit_with_r {
+  static constexpr const char* name = "visit_with_r";
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = true;
+
+  template <typename Op, typename... Vs>
+  static std::uint64_t run(const Op& op, const Vs&... vs) {
+    return tools::visit_with_r<std::uint64_t>(op, vs...);
+  }
+
+  template <typename Op, typename... Vs>
+  static long table_bytes() {
+    return auto_dispatch_table_bytes<Op, Vs...>();
+  }
+};
+
+// One strategy for every table size: flat against padded shows what the
+// padding costs in bytes and saves in latency.
+template <typename Strategy>
+struct strategy_visit {
+  static constexpr const char* name = Strategy::name;
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = true;
+
+  template <typename Op, typename... Vs>
+  static std::uint64_t run(const Op& op, const Vs&... vs) {
+    return tools::visit_with_r<std::uint64_t>(typename Strategy::type{}, op,
+                                              vs...);
+  }
+
+  template <typename Op, typename... Vs>
+  static long table_bytes() {
+    return strategy_table_bytes<Op, Vs...>(typename Strategy::type{});
+  }
+};
+
+struct flat_table {
+  using type = tools::flat_table_dispatch;
+  static constexpr const char* name = "flat_table";
+};
+
+struct padded_table {
+  using type = tools::padded_table_dispatch;
+  static constexpr const char* name = "padded_table";
+};
+
+// The constant distribution is all index 0: every dispatch is a hit for
+// visit_likely<first> and a miss, then the auto_dispatch table, for
+// visit_likely<last>.
+template <bool predict_first>
+struct likely_visit {
+  static constexpr const char* name =
+      predict_first ? "visit_likely<first>" : "visit_likely<last>";
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = true;
+
+  template <typename Op, typename... Vs>
+  static std::uint64_t run(const Op& op, const Vs&... vs) {
+    return tools::visit_likely<(
+        predict_first ? 0 : std::variant_size_v<Vs> - 1)...>(op, vs...);
+  }
+
+  template <typename Op, typename... Vs>
+  static long table_bytes() {
+    return auto_dispatch_table_bytes<Op, Vs...>();
+  }
+};
+
+// Batch implementations get the whole input in one call, single variant
+// only: the runs are made of consecutive inputs.
+template <typename Op>
+struct accumulate {
+  const Op* op;
+  std::uint64_t* sum;
+
+  template <typename T>
+  void operator()(const T& x) const {
+    *sum += (*op)(x);
+  }
+};
+
+template <typename Op>
+struct accumulate_any_order : accumulate<Op> {};
+
+// Sums whole spans: the loop over a span can be vectorized.
+template <typename Op>
+struct accumulate_spans : accumulate<Op> {
+  using accumulate<Op>::operator();
+
+  template <typename T>
+  void operator()(tools::span<const T> xs) const {
+    std::uint64_t res = 0;
+    for (const T& x : xs) {
+      res += (*this->op)(x);
+    }
+    *this->sum += res;
+  }
+};
+
+}  // namespace bench
+
+namespace tools {
+
+template <typename Op>
+struct visit_order_independent<bench::accumulate_any_order<Op>>
+    : std::true_type {};
+
+template <typename Op, typename T>
+struct takes_spans<bench::accumulate_spans<Op>, T> : std::true_type {};
+
+}  // namespace tools
+
+namespace bench {
+
+template <bool any_order>
+struct range_visit {
+  static constexpr const char* name =
+      any_order ? "visit_range<any_order>" : "visit_range";
+  static constexpr bool batch = true;
+
+  template <typename Op>
+  using Accumulate = std::conditional_t<any_order, accumulate_any_order<Op>,
+                                        accumulate<Op>>;
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = sizeof...(Vs) == 1;
+
+  template <typename Op, typename V>
+  static std::uint64_t run_range(const Op& op, const std::vector<V>& inputs) {
+    std::uint64_t sum = 0;
+    const accumulate<Op> acc{&op, &sum};
+    tools::visit_range(Accumulate<Op>{acc}, inputs.begin(), inputs.end());
+    return sum;
+  }
+
+  template <typename Op, typename V>
+  static long table_bytes() {
+    return sizeof(tools::visit_range_runs<
+                  Accumulate<Op>, typename std::vector<V>::const_iterator>);
+  }
+};
+
+struct span_visit {
+  static constexpr const char* name = "visit_spans";
+  static constexpr bool batch = true;
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = sizeof...(Vs) == 1;
+
+  template <typename Op, typename V>
+  static std::uint64_t run_range(const Op& op, const std::vector<V>& inputs) {
+    std::uint64_t sum = 0;
+    const accumulate<Op> acc{&op, &sum};
+    tools::visit_spans(accumulate_spans<Op>{acc}, inputs.begin(),
+                       inputs.end());
+    return sum;
+  }
+
+  template <typename Op, typename V>
+  static long table_bytes() {
+    return sizeof(tools::visit_spans_runs<
+                  accumulate_spans<Op>,
+                  typename std::vector<V>::const_iterator>);
+  }
+};
+
+struct tools_visit {
+  static constexpr const char* name = "visit";
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = true;
+
+  template <typename Op, typename... Vs>
+  static std::uint64_t run(const Op& op, const Vs&... vs) {
+    return tools::visit(op, vs...);
+  }
+
+  template <typename Op, typename... Vs>
+  static long table_bytes() {
+    return auto_dispatch_table_bytes<Op, Vs...>();
+  }
+};
+
+struct v3_visit {
+  static constexpr const char* name = "v3::visit";
+
+  template <typename Op, typename... Vs>
+  static constexpr bool supported = true;
+
+  template <typename Op, typename... Vs>
+  static std::uint64_t run(const Op& op, const Vs&... vs) {
+    return v3::visit(op, vs...);
+  }
+
+  template <typename Op, typename... Vs>
+  static long table_bytes() {
+    return sizeof(v3::_visit_r_impl<std::uint64_t, const Op&,
+                                    const Vs&...>::vtable);
+  }
+};
+
+// Inputs -----------------------------------------------------------------
+
+enum class distribution { constant, round_robin, uniform, zipf };
+
+constexpr distribution all_distributions[] = {
+    distribution::constant, distribution::round_robin, distribution::uniform,
+    distribution::zipf};
+
+const char* name(distribution d) {
+  switch (d) {
+    case distribution::constant:
+      return "constant";
+    case distribution::round_robin:
+      return "round_robin";
+    case distribution::uniform:
+      return "uniform";
+    case distribution::zipf:
+      return "zipf";
+  }
+  return "";
+}
+
+constexpr size_t dispatches = 4096;
+
+std::vector<size_t> make_indices(distribution d,
+                                 size_t alternatives,
+                                 size_t count) {
+  std::mt19937 rng(count + alternatives);
+  std::vector<double> zipf_weights(alternatives);
+  for (size_t i = 0; i < alternatives; ++i) {
+    zipf_weights[i] = 1.0 / static_cast<double>(i + 1);
+  }
+  std::discrete_distribution<size_t> zipf(zipf_weights.begin(),
+                                          zipf_weights.end());
+  std::uniform_int_distribution<size_t> uniform(0, alternatives - 1);
+
+  std::vector<size_t> res(count);
+  for (size_t i = 0; i < count; ++i) {
+    switch (d) {
+      case distribution::constant:
+        res[i] = 0;
+        break;
+      case distribution::round_robin:
+        res[i] = i % alternatives;
+        break;
+      case distribution::uniform:
+        res[i] = uniform(rng);
+        break;
+      case distribution::zipf:
+        res[i] = zipf(rng);
+        break;
+    }
+  }
+  return res;
+}
+
+template <typename V, size_t... idxs>
+std::vector<V> make_variants(const std::vector<size_t>& indices,
+                             std::index_sequence<idxs...>) {
+  const V prototypes[] = {
+      V{std::in_place_index<idxs>, alt<idxs>{std::uint32_t{idxs * 7}}}...};
+  std::vector<V> res;
+  res.reserve(indices.size());
+  for (size_t idx : indices) {
+    res.push_back(prototypes[idx]);
+  }
+  return res;
+}
+
+// Runner -----------------------------------------------------------------
+
+struct options {
+  bool smoke = false;
+  int repetitions = 5;
+  std::chrono::nanoseconds min_time = std::chrono::milliseconds(10);
+  std::vector<std::string> filters;
+
+  bool selected(const char* config) const {
+    return filters.empty() ||
+           std::any_of(filters.begin(), filters.end(),
+                       [&](const std::string& f) {
+                         return !std::strncmp(config, f.c_str(), f.size());
+                       });
+  }
+};
+
+template <typename Impl, typename = void>
+struct is_batch : std::false_type {};
+
+template <typename Impl>
+struct is_batch<Impl, std::void_t<decltype(Impl::batch)>> : std::true_type {};
+
+template <typename Impl, typename Op, typename V, size_t... ks>
+std::uint64_t run_once(const Op& op,
+                       const std::vector<V>& inputs,
+                       std::index_sequence<ks...>) {
+  if constexpr (is_batch<Impl>::value) {
+    return Impl::run_range(op, inputs);
+  } else {
+    constexpr size_t arity = sizeof...(ks);
+    std::uint64_t sum = 0;
+    for (size_t i = 0; i + arity <= inputs.size(); i += arity) {
+      sum += Impl::run(op, inputs[i + ks]...);
+    }
+    return sum;
+  }
+}
+
+template <typename Impl, typename Op, typename V, size_t... ks>
+void run_case(const options& opts,
+              distribution d,
+              std::index_sequence<ks...> arity_s) {
+  constexpr size_t arity = sizeof...(ks);
+  constexpr size_t alternatives = std::variant_size_v<V>;
+
+  char config[128];
+  std::snprintf(config, sizeof(config), "%s,%zu,%zu,%s,%s", Impl::name,
+                arity, alternatives, Op::name, name(d));
+  if (!opts.selected(config)) {
+    return;
+  }
+
+  const std::vector<V> inputs = make_variants<V>(
+      make_indices(d, alternatives, dispatches * arity),
+      std::make_index_sequence<alternatives>{});
+  const Op op;
+
+  using clock = std::chrono::steady_clock;
+  do_not_optimize(run_once<Impl>(op, inputs, arity_s));
+
+  std::vector<double> samples;
+  for (int i = 0; i < (opts.smoke ? 1 : opts.repetitions); ++i) {
+    size_t reps = 0;
+    auto start = clock::now();
+    auto elapsed = clock::duration{};
+    do {
+      do_not_optimize(run_once<Impl>(op, inputs, arity_s));
+      ++reps;
+      elapsed = clock::now() - start;
+    } while (!opts.smoke && elapsed < opts.min_time);
+
+    samples.push_back(
+        static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                .count()) /
+        static_cast<double>(reps * dispatches));
+  }
+  std::sort(samples.begin(), samples.end());
+  double median = samples.size() % 2
+                      ? samples[samples.size() / 2]
+                      : (samples[samples.size() / 2 - 1] +
+                         samples[samples.size() / 2]) /
+                            2;
+
+  long bytes = Impl::template table_bytes<Op, repeat<ks, V>...>();
+  char bytes_str[32] = "-";
+  if (bytes >= 0) {
+    std::snprintf(bytes_str, sizeof(bytes_str), "%ld", bytes);
+  }
+  std::printf("%s,%.3f,%.3f,%s\n", config, samples.front(), median,
+              bytes_str);
+}
+
+template <typename Impl, typename Op, typename V, size_t... ks>
+void run_cases(const options& opts, std::index_sequence<ks...> arity_s) {
+  if constexpr (Impl::template supported<Op, repeat<ks, V>...>) {
+    for (distribution d : all_distributions) {
+      run_case<Impl, Op, V>(opts, d, arity_s);
+    }
+  }
+}
+
+template <size_t arity, size_t alternatives, typename Op, typename... Impls>
+void run_impls(const options& opts) {
+  using V = variant_n<alternatives>;
+  (run_cases<Impls, Op, V>(opts, std::make_index_sequence<arity>{}), ...);
+}
+
+template <size_t arity, size_t alternatives, typename Op>
+void run_op(const options& opts) {
+  run_impls<arity, alternatives, Op, std_visit, simplified_visit,
+            visit_with_r_simplified, visit_with_r, tools_visit,
+            strategy_visit<flat_table>, strategy_visit<padded_table>,
+            likely_visit<true>, likely_visit<false>,
+            range_visit<false>, range_visit<true>, span_visit,
+            v3_visit>(opts);
+}
+
+template <size_t arity, size_t alternatives>
+void run_config(const options& opts) {
+  run_op<arity, alternatives, trivial_op>(opts);
+  run_op<arity, alternatives, heavy_op>(opts);
+}
+
+template <size_t arity, size_t... alternatives>
+void run_arity(const options& opts) {
+  (run_config<arity, alternatives>(opts), ...);
+}
+
+}  // namespace bench
+
+int main(int argc, char** argv) {
+  bench::options opts;
+  for (int i = 1; i < argc; ++i) {
+    bool has_value = i + 1 < argc;
+    if (!std::strcmp(argv[i], "--smoke")) {
+      opts.smoke = true;
+    } else if (!std::strcmp(argv[i], "--repetitions") && has_value) {
+      opts.repetitions = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--min-time-ms") && has_value) {
+      opts.min_time = std::chrono::milliseconds(std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--filter") && has_value) {
+      opts.filters.push_back(argv[++i]);
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--smoke] [--repetitions n] [--min-time-ms ms] "
+                   "[--filter prefix]\n",
+                   argv[0]);
+      return 1;
+    }
+  }
+
+  std::printf(
+      "impl,arity,alternatives,visitor,distribution,min_ns,median_ns,"
+      "table_bytes\n");
+
+  // Tables are kept under ~1k entries to keep the build reasonable.
+  bench::run_arity<1, 2, 4, 8, 16, 32, 64>(opts);
+  bench::run_arity<2, 2, 4, 8, 16, 32>(opts);
+  bench::run_arity<3, 2, 4, 8>(opts);
+  bench::run_arity<4, 2, 4>(opts);
+}
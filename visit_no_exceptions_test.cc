@@ -0,0 +1,89 @@
+// Built with -fno-exceptions: valueless variants go to the handler and
+// visit is noexcept as soon as the visitor is.
+
+#include <csetjmp>
+#include <variant>
+
+namespace {
+
+std::jmp_buf valueless_jump;
+int valueless_calls = 0;
+
+[[noreturn]] void valueless_handler() {
+  ++valueless_calls;
+  std::longjmp(valueless_jump, 1);
+}
+
+}  // namespace
+
+#define TOOLS_VISIT_VALUELESS_HANDLER valueless_handler
+#include "visit.h"
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+// Defined in visit_no_exceptions_test_helper.cc, built with exceptions:
+// a valueless variant cannot be made without throwing.
+struct throws_on_construction {
+  throws_on_construction();
+  throws_on_construction(const throws_on_construction&) {}
+};
+
+using maybe_valueless = std::variant<int, throws_on_construction>;
+
+maybe_valueless make_valueless();
+
+namespace tools {
+
+static_assert(!TOOLS_VISIT_HAS_EXCEPTIONS);
+
+struct nothrow_op {
+  template <typename... Ts>
+  int operator()(const Ts&...) const noexcept {
+    return sizeof...(Ts);
+  }
+};
+
+struct throwing_op {
+  template <typename... Ts>
+  int operator()(const Ts&...) const {
+    return sizeof...(Ts);
+  }
+};
+
+static_assert(noexcept(tools::visit(nothrow_op{}, maybe_valueless{})));
+static_assert(noexcept(tools::visit<long>(nothrow_op{}, maybe_valueless{},
+                                          maybe_valueless{})));
+static_assert(!noexcept(tools::visit(throwing_op{}, maybe_valueless{})));
+
+template <typename Strategy>
+void valueless_strategy_test(Strategy strategy) {
+  maybe_valueless valueless = make_valueless();
+  REQUIRE(valueless.valueless_by_exception());
+  maybe_valueless v{1};
+
+  valueless_calls = 0;
+  if (!setjmp(valueless_jump)) {
+    visit_with_r<int>(strategy, nothrow_op{}, valueless);
+  }
+  if (!setjmp(valueless_jump)) {
+    visit_with_r<int>(strategy, nothrow_op{}, v, valueless);
+  }
+  REQUIRE(valueless_calls == 2);
+  REQUIRE(visit_with_r<int>(strategy, nothrow_op{}, v, v) == 2);
+}
+
+TEST_CASE("visit, valueless handler") {
+  valueless_strategy_test(flat_table_dispatch{});
+  valueless_strategy_test(switch_dispatch{});
+  valueless_strategy_test(nested_dispatch{});
+
+  maybe_valueless valueless = make_valueless();
+  valueless_calls = 0;
+  if (!setjmp(valueless_jump)) {
+    tools::visit(nothrow_op{}, valueless);
+  }
+  REQUIRE(valueless_calls == 1);
+}
+
+}  // namespace tools
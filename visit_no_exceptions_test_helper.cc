@@ -0,0 +1,24 @@
+// The exceptions half of visit_no_exceptions_test.cc.
+
+#include <stdexcept>
+#include <variant>
+
+struct throws_on_construction {
+  throws_on_construction();
+  throws_on_construction(const throws_on_construction&) {}
+};
+
+throws_on_construction::throws_on_construction() {
+  throw std::runtime_error("aaaa");
+}
+
+using maybe_valueless = std::variant<int, throws_on_construction>;
+
+maybe_valueless make_valueless() {
+  maybe_valueless res{3};
+  try {
+    res.emplace<throws_on_construction>();
+  } catch (const std::runtime_error&) {
+  }
+  return res;
+}
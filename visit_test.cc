@@ -1,5 +1,13 @@
 #include "visit.h"
 
+#include <list>
+#include <vector>
+
+#ifdef TOOLS_VISIT_INSTRUMENTATION
+#include <sstream>
+#include <thread>
+#endif
+
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
@@ -55,7 +63,15 @@ TEST_CASE("visit, table_index_math") {
     }
   }
 
+  // Strides 8, 2, 1: shifts by 3, 1, 0.
+  static_assert(t.power_of_two_strides);
+  REQUIRE(t.shifts_a == std::array<size_t, 3>{3, 1, 0});
+  static_assert(!table_index_math<4, 3, 2>::power_of_two_strides);
+  static_assert(table_index_math<4, 3, 2>::as_linear({3, 2, 1}) == 23);
+
   is_same_test(t.as_multi_s<0>(), std::index_sequence<0, 0, 0>{});
+  is_same_test(decltype(t)::multi_s<23>{}, std::index_sequence<2, 3, 1>{});
+  is_same_test(decltype(t)::multi_s<13>{}, std::index_sequence<1, 2, 1>{});
 }
 
 template <size_t idx, size_t... sequence>
@@ -129,6 +145,27 @@ TEST_CASE("visit, common_type") {
   struct A {};
   is_same_test(common_type(type_list<int, A>{}), null_t{});
   is_same_test(common_type(type_list<int, char>{}), type_t<int>{});
+  is_same_test(common_type(type_list<const int&, const int&>{}),
+               type_t<int>{});
+  is_same_test(common_type(type_list<>{}), null_t{});
+
+  // More than one chunk.
+  constexpr auto mixed = make_type_table<100>([](auto seq) {
+    if constexpr (get<0>(seq) == 70) {
+      return type_t<long>{};
+    } else {
+      return type_t<char>{};
+    }
+  });
+  is_same_test(common_type(mixed), type_t<long>{});
+  constexpr auto no_common = make_type_table<100>([](auto seq) {
+    if constexpr (get<0>(seq) == 70) {
+      return type_t<A>{};
+    } else {
+      return type_t<char>{};
+    }
+  });
+  is_same_test(common_type(no_common), null_t{});
 }
 
 TEST_CASE("visit, type_table") {
@@ -172,6 +209,9 @@ TEST_CASE("visit, visit with R") {
   {
     struct Throws {
       Throws() { throw std::runtime_error("aaaa"); }
+      // Not trivially copyable, otherwise emplace is allowed to leave the
+      // old value alone.
+      Throws(const Throws&) {}
     };
 
     std::variant<Throws, int> v{3};
@@ -186,6 +226,560 @@ TEST_CASE("visit, visit with R") {
   }
 }
 
+TEST_CASE("visit, unchecked_get") {
+  using test_t = std::variant<int, char>;
+  static_assert(unchecked_get<1>(test_t{'a'}) == 'a');
+
+  test_t v{3};
+  REQUIRE(&unchecked_get<0>(v) == &std::get<0>(v));
+  static_assert(std::is_same_v<decltype(unchecked_get<0>(std::move(v))),
+                               decltype(std::get<0>(std::move(v)))>);
+  static_assert(std::is_same_v<decltype(unchecked_get<0>(std::as_const(v))),
+                               decltype(std::get<0>(std::as_const(v)))>);
+}
+
+TEST_CASE("visit, static vtable") {
+  using test_t = std::variant<int, char>;
+  auto op = [](auto&&...) { return 0; };
+  using table_t = decltype(visit_vtable<int, decltype(op)&, test_t&>);
+
+  static_assert(std::is_same_v<table_t, const table<int (*)(decltype(op)&,
+                                                           test_t&), 3>>);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(
+              &visit_vtable<int, decltype(op)&, test_t&>) %
+              cache_line_size ==
+          0);
+}
+
+TEST_CASE("visit, switch_on_index") {
+  for (size_t i = 0; i < 70; ++i) {
+    REQUIRE(switch_on_index<size_t, 70>(i, [](auto idx) { return idx(); }) ==
+            i);
+  }
+  static_assert(switch_on_index<size_t, 40>(35, [](auto idx) {
+                  return idx * 2;
+                }) == 70);
+}
+
+TEST_CASE("visit, if_else_on_index and binary_search_on_index") {
+  for (size_t i = 0; i < 13; ++i) {
+    REQUIRE(if_else_on_index<size_t, 13>(i, [](auto idx) { return idx(); }) ==
+            i);
+    REQUIRE(binary_search_on_index<size_t, 0, 13>(
+                i, [](auto idx) { return idx(); }) == i);
+  }
+}
+
+template <typename Strategy>
+void dispatch_strategy_test(Strategy strategy) {
+  using test_t = std::variant<int, char, double>;
+
+  constexpr auto visitor = [](auto x, auto y) {
+    return P<size_t>{sizeof(x), sizeof(y)};
+  };
+
+  static_assert(visit_with_r<P<size_t>>(strategy, visitor, test_t{3},
+                                        test_t{'a'}) == P<size_t>{4, 1});
+  static_assert(visit_with_r<P<size_t>>(strategy, visitor, test_t{1.0},
+                                        test_t{3}) == P<size_t>{8, 4});
+
+  test_t values[] = {1, 'a', 1.0};
+  for (const test_t& x : values) {
+    for (const test_t& y : values) {
+      REQUIRE(visit_with_r<P<size_t>>(strategy, visitor, x, y) ==
+              visit_with_r<P<size_t>>(flat_table_dispatch{}, visitor, x, y));
+      REQUIRE(tools::visit(strategy, visitor, x, y) ==
+              tools::visit(visitor, x, y));
+    }
+  }
+}
+
+TEST_CASE("visit, dispatch strategies") {
+  dispatch_strategy_test(flat_table_dispatch{});
+  dispatch_strategy_test(switch_dispatch{});
+  dispatch_strategy_test(if_else_dispatch{});
+  dispatch_strategy_test(binary_search_dispatch{});
+  dispatch_strategy_test(nested_dispatch{});
+  dispatch_strategy_test(compressed_table_dispatch{});
+  dispatch_strategy_test(padded_table_dispatch{});
+  dispatch_strategy_test(likely_dispatch<0, 1>{});
+  dispatch_strategy_test(likely_dispatch_with<switch_dispatch, 2, 2>{});
+  dispatch_strategy_test(auto_dispatch<>{});
+  dispatch_strategy_test(auto_dispatch<0, 0>{});
+}
+
+struct throws_on_construction {
+  throws_on_construction() { throw std::runtime_error("aaaa"); }
+  throws_on_construction(const throws_on_construction&) {}
+};
+
+using maybe_valueless = std::variant<int, throws_on_construction>;
+
+maybe_valueless make_valueless() {
+  maybe_valueless res{3};
+  try {
+    res.emplace<throws_on_construction>();
+  } catch (const std::runtime_error&) {
+  }
+  return res;
+}
+
+template <typename Strategy>
+void valueless_strategy_test(Strategy strategy) {
+  maybe_valueless valueless = make_valueless();
+  REQUIRE(valueless.valueless_by_exception());
+  maybe_valueless v{1};
+
+  auto visitor = [](const auto&...) { return 0; };
+  REQUIRE_THROWS_AS(visit_with_r<int>(strategy, visitor, valueless),
+                    std::bad_variant_access);
+  REQUIRE_THROWS_AS(visit_with_r<int>(strategy, visitor, v, valueless),
+                    std::bad_variant_access);
+  REQUIRE_THROWS_AS(visit_with_r<int>(strategy, visitor, valueless, v),
+                    std::bad_variant_access);
+  REQUIRE(visit_with_r<int>(strategy, visitor, v, v) == 0);
+}
+
+using never_valueless_t = std::variant<long long, unsigned char>;
+
+template <>
+struct never_valueless<never_valueless_t> : std::true_type {};
+
+TEST_CASE("visit, valueless") {
+  valueless_strategy_test(flat_table_dispatch{});
+  valueless_strategy_test(switch_dispatch{});
+  valueless_strategy_test(if_else_dispatch{});
+  valueless_strategy_test(binary_search_dispatch{});
+  valueless_strategy_test(nested_dispatch{});
+  valueless_strategy_test(compressed_table_dispatch{});
+  valueless_strategy_test(padded_table_dispatch{});
+  valueless_strategy_test(auto_dispatch<>{});
+
+  maybe_valueless valueless = make_valueless();
+  REQUIRE(slot_index(valueless) == 0);
+  REQUIRE(slot_index(maybe_valueless{1}) == 1);
+  maybe_valueless v{1};
+  REQUIRE_THROWS_AS(
+      visit_symmetric([](auto, auto) { return 0; }, v, valueless),
+      std::bad_variant_access);
+
+  constexpr never_valueless_t c{std::in_place_index<1>, 'a'};
+  static_assert(dispatch_size<never_valueless_t> == 2);
+  static_assert(slot_index(c) == 1);
+  auto op = [](auto x) { return sizeof(x); };
+  static_assert(
+      visit_vtable<size_t, decltype(op)&, const never_valueless_t&>
+          .data.size() == 2);
+  REQUIRE(tools::visit(op, c) == 1);
+}
+
+TEST_CASE("visit, noexcept") {
+  auto nothrow_op = [](auto) noexcept { return 0; };
+  auto op = [](auto) { return 0; };
+  auto mixed_op = overload{[](long long) noexcept {}, [](unsigned char) {}};
+
+  never_valueless_t x;
+  maybe_valueless y;
+
+  static_assert(noexcept(tools::visit(nothrow_op, x)));
+  static_assert(noexcept(tools::visit<long>(nothrow_op, x)));
+  static_assert(noexcept(tools::visit(switch_dispatch{}, nothrow_op, x)));
+  static_assert(!noexcept(tools::visit(op, x)));
+  static_assert(!noexcept(tools::visit(mixed_op, x)));
+  auto nothrow_binary_op = [](auto, auto) noexcept { return 0; };
+  static_assert(noexcept(tools::visit(nothrow_binary_op, x, x)));
+  static_assert(!noexcept(tools::visit(nothrow_binary_op, x, y)));
+  static_assert(!noexcept(tools::visit(nothrow_op, y)));
+
+  // Throwing conversion to R.
+  struct throws_from_int {
+    throws_from_int(int) {}
+  };
+  static_assert(!noexcept(tools::visit<throws_from_int>(nothrow_op, x)));
+}
+
+struct by_const_ref_op {
+  template <typename T>
+  int operator()(const T&) const {
+    return 0;
+  }
+  template <typename T>
+  int operator()(T&&) const {
+    return 1;
+  }
+};
+
+template <>
+struct visit_by_const_ref<by_const_ref_op> : std::true_type {};
+
+TEST_CASE("visit, visit_by_const_ref") {
+  using v = std::variant<int, char>;
+  v x{1};
+  by_const_ref_op op;
+
+  // Every call goes through the const& table, even if an overload for
+  // T&& exists (which is what the trait promises does not happen).
+  REQUIRE(tools::visit(op, x) == 0);
+  REQUIRE(tools::visit(op, std::as_const(x)) == 0);
+  REQUIRE(tools::visit(op, std::move(x)) == 0);
+  REQUIRE(tools::visit(by_const_ref_op{}, v{'a'}) == 0);
+  REQUIRE(visit_with_r<int>(flat_table_dispatch{}, op, std::move(x)) == 0);
+
+  struct plain_op : by_const_ref_op {};
+  REQUIRE(tools::visit(plain_op{}, std::move(x)) == 1);
+}
+
+TEST_CASE("visit, auto_dispatch") {
+  using v2 = std::variant<int, char>;
+  using v4 = std::variant<int, char, short, long>;
+
+  is_same_test(auto_dispatch<>::select<v2>(), if_else_dispatch{});
+  is_same_test(auto_dispatch<>::select<v4>(), switch_dispatch{});
+  is_same_test(auto_dispatch<>::select<v4, v4, v2>(), flat_table_dispatch{});
+  is_same_test(auto_dispatch<1, 64>::select<v2>(), switch_dispatch{});
+  is_same_test(auto_dispatch<1, 128>::select<v4, v4, v2>(), switch_dispatch{});
+  is_same_test(auto_dispatch<>::select<v4, v4, v4, v4, v4>(),
+               nested_dispatch{});
+  is_same_test(auto_dispatch<0, 0, 8>::select<v4, v2>(), nested_dispatch{});
+  is_same_test(auto_dispatch<0, 0, 8>::select<v4>(), flat_table_dispatch{});
+
+  static_assert(tools::visit<int>(switch_dispatch{}, [](auto) { return 1; },
+                                  v2{}) == 1);
+}
+
+TEST_CASE("visit, nested_dispatch") {
+  using v3 = std::variant<int, char, double>;
+  using v4 = std::variant<int, char, short, long>;
+
+  auto op = [](auto x, auto y, auto z) {
+    return P<size_t>{sizeof(x) + sizeof(y), sizeof(z)};
+  };
+
+  using generator = nested_dispatch_generator<P<size_t>, decltype(op)&,
+                                              const v3&, v4&, const v3&>;
+
+  static_assert(generator::level_table<>.size() == 4);
+  static_assert(generator::level_table<3>.size() == 5);
+
+  v4 y = short{1};
+  REQUIRE(visit_with_r<P<size_t>>(nested_dispatch{}, op, v3{'a'}, y,
+                                  v3{1.0}) == P<size_t>{3, 8});
+  y = 1L;
+  REQUIRE(visit_with_r<P<size_t>>(nested_dispatch{}, op, v3{2}, y, v3{3}) ==
+          P<size_t>{12, 4});
+}
+
+TEST_CASE("visit, compressed_vtable") {
+  using v4 = std::variant<int, char, int, char>;
+  using v2 = std::variant<int, int>;
+
+  REQUIRE(canonical_alternatives<v4> == std::array<size_t, 4>{0, 1, 0, 1});
+  REQUIRE(canonical_alternatives<v2> == std::array<size_t, 2>{0, 0});
+
+  auto op = [](auto x, auto y) { return P<size_t>{sizeof(x), sizeof(y)}; };
+  using vtable = compressed_vtable<P<size_t>, decltype(op)&, v4&, v2&>;
+
+  // The valueless entries share one thunk too.
+  static_assert(vtable::size_linear == 15);
+  static_assert(vtable::unique_size == 3);
+  static_assert(vtable::dedup_ratio == 5.0);
+  static_assert(std::is_same_v<vtable::offset_type, std::uint8_t>);
+  REQUIRE(vtable::offsets == std::array<std::uint8_t, 15>{
+                                 0, 0, 0, 0, 1, 1, 0, 2, 2, 0, 1, 1, 0, 2, 2});
+  // One cache line each for 15 offsets and 3 thunks: no gain at this size.
+  static_assert(vtable::flat_bytes == 2 * cache_line_size);
+  static_assert(vtable::compressed_bytes == 2 * cache_line_size);
+
+  auto ternary_op = [](auto, auto, auto) {};
+  using ternary_vtable =
+      compressed_vtable<void, decltype(ternary_op)&, v4&, v4&, v4&>;
+  static_assert(ternary_vtable::unique_size == 9);
+  static_assert(ternary_vtable::flat_bytes == 16 * cache_line_size);
+  static_assert(ternary_vtable::compressed_bytes == 4 * cache_line_size);
+
+  v4 x{std::in_place_index<3>, 'a'};
+  v2 y{std::in_place_index<1>, 1};
+  REQUIRE(visit_with_r<P<size_t>>(compressed_table_dispatch{}, op, x, y) ==
+          P<size_t>{1, 4});
+  x.emplace<2>(1);
+  REQUIRE(tools::visit(compressed_table_dispatch{}, op, x, y) ==
+          P<size_t>{4, 4});
+
+  auto unary_op = [](auto) {};
+  using unary_vtable = compressed_vtable<void, decltype(unary_op)&,
+                                         std::variant<int, char>&>;
+  static_assert(unary_vtable::dedup_ratio == 1.0);
+}
+
+TEST_CASE("visit, padded_table_dispatch") {
+  using v3 = std::variant<int, char, double>;
+  static_assert(dispatch_size<v3> == 4);
+  static_assert(padded_dispatch_size<v3> == 4);
+  static_assert(padded_dispatch_size<std::variant<int, char>> == 4);
+  static_assert(padded_dispatch_size<never_valueless_t> == 2);
+
+  using v4 = std::variant<int, char, double, float>;
+  auto op = [](auto x, auto y) { return P<size_t>{sizeof(x), sizeof(y)}; };
+  constexpr auto& vtable = padded_visit_vtable<P<size_t>, decltype(op)&,
+                                               const v4&, const v3&>;
+  static_assert(vtable.data.size() == 8 * 4);
+  static_assert(padded_linear_index(v4{1.0f}, v3{'a'}) == (4 << 2 | 2));
+
+  // Padding entries throw like the valueless ones.
+  REQUIRE_THROWS_AS(vtable.data[5 << 2 | 3](op, v4{}, v3{}),
+                    std::bad_variant_access);
+  REQUIRE(visit(padded_table_dispatch{}, op, v4{1.0f}, v3{'a'}) ==
+          P<size_t>{4, 1});
+}
+
+TEST_CASE("visit, visit_likely") {
+  struct quote {};
+  struct trade {};
+  using message = std::variant<trade, quote>;
+
+  struct {
+    constexpr int operator()(quote) const { return 1; }
+    constexpr int operator()(trade) const { return 2; }
+  } op;
+
+  static_assert(visit_likely<1>(op, message{quote{}}) == 1);
+  static_assert(visit_likely<1>(op, message{trade{}}) == 2);
+  auto nothrow_op = [](auto) noexcept {};
+  static_assert(noexcept(visit_likely<0>(nothrow_op, never_valueless_t{})));
+  static_assert(!noexcept(visit_likely<0>(nothrow_op, maybe_valueless{})));
+  REQUIRE_THROWS_AS(visit_likely<0>(nothrow_op, make_valueless()),
+                    std::bad_variant_access);
+
+  auto sum = [](auto x, auto y) { return x + y; };
+  using v_t = std::variant<int, double>;
+  REQUIRE(visit_likely<0, 0>(sum, v_t{1}, v_t{2}) == 3.0);
+  REQUIRE(visit_likely<0, 0>(sum, v_t{1}, v_t{2.5}) == 3.5);
+  is_same_test(visit_likely<0, 0>(sum, v_t{1}, v_t{2}), 0.0);
+}
+
+struct rare_error {
+  int code;
+};
+
+template <>
+struct is_cold_alternative<rare_error> : std::true_type {};
+
+TEST_CASE("visit, is_cold_alternative") {
+  using v_t = std::variant<int, rare_error>;
+  auto op = [](auto x) { return sizeof(x) + 1; };
+  using generator = visit_vtable_generator<size_t, decltype(op)&, v_t&>;
+
+  static_assert(!generator::is_cold(std::index_sequence<0>{}));
+  static_assert(generator::is_cold(std::index_sequence<1>{}));
+
+  constexpr auto& vtable = visit_vtable<size_t, decltype(op)&, v_t&>;
+  static_assert(vtable.data[2] ==
+                generator::cold_ptr(std::index_sequence<1>{}));
+  static_assert(vtable.data[1] !=
+                generator::cold_ptr(std::index_sequence<0>{}));
+
+  v_t v{rare_error{1}};
+  REQUIRE(tools::visit(op, v) == sizeof(rare_error) + 1);
+  REQUIRE(tools::visit(switch_dispatch{}, op, v) == sizeof(rare_error) + 1);
+  v = 1;
+  REQUIRE(tools::visit(op, v) == sizeof(int) + 1);
+
+  auto binary_op = [](auto x, auto y) { return sizeof(x) + sizeof(y); };
+  v_t error{rare_error{2}};
+  REQUIRE(tools::visit(nested_dispatch{}, binary_op, v, error) ==
+          sizeof(int) + sizeof(rare_error));
+}
+
+struct record_op {
+  std::vector<std::string>* calls;
+
+  template <typename... Ts>
+  void operator()(const Ts&... xs) const {
+    std::string call;
+    ((call += std::to_string(xs) + ","), ...);
+    calls->push_back(call);
+  }
+};
+
+struct order_independent_record_op : record_op {};
+
+template <>
+struct visit_order_independent<order_independent_record_op> : std::true_type {
+};
+
+TEST_CASE("visit, visit_range") {
+  using v_t = std::variant<int, char, double>;
+  const std::vector<v_t> xs{1, 2, 'a', 'b', 'c', 3.0, 4, 'd', 5.5};
+  const std::vector<v_t> ys{0, 'x', 'y', 1.0, 2.0, 3.0, 4.0, 5, 6};
+
+  auto expected = [](const auto&... ranges) {
+    std::vector<std::string> res;
+    for (size_t i = 0; i < 9; ++i) {
+      tools::visit(record_op{&res}, ranges[i]...);
+    }
+    return res;
+  };
+
+  std::vector<std::string> calls;
+  visit_range(record_op{&calls}, xs.begin(), xs.end());
+  REQUIRE(calls == expected(xs));
+
+  calls.clear();
+  visit_range(record_op{&calls}, xs.begin(), xs.end(), ys.begin());
+  REQUIRE(calls == expected(xs, ys));
+
+  // Forward iterators, no prefetch.
+  const std::list<v_t> list(xs.begin(), xs.end());
+  calls.clear();
+  visit_range(record_op{&calls}, list.begin(), list.end());
+  REQUIRE(calls == expected(xs));
+
+  calls.clear();
+  visit_range(record_op{&calls}, xs.begin(), xs.begin());
+  REQUIRE(calls.empty());
+
+  // Random access with rvalue elements: nothing to prefetch.
+  calls.clear();
+  visit_range(record_op{&calls}, std::make_move_iterator(xs.begin()),
+              std::make_move_iterator(xs.end()));
+  REQUIRE(calls == expected(xs));
+
+  // Grouped by alternatives, in order within a group.
+  calls.clear();
+  visit_range(order_independent_record_op{{&calls}}, xs.begin(), xs.end());
+  REQUIRE(calls == std::vector<std::string>{"1,", "2,", "4,", "97,", "98,",
+                                            "99,", "100,", "3.000000,",
+                                            "5.500000,"});
+
+  std::vector<std::string> moved_calls;
+  visit_range(order_independent_record_op{{&moved_calls}},
+              std::make_move_iterator(xs.begin()),
+              std::make_move_iterator(xs.end()));
+  REQUIRE(moved_calls == calls);
+
+  const std::vector<maybe_valueless> valueless{1, make_valueless()};
+  REQUIRE_THROWS_AS(
+      visit_range([](const auto&) {}, valueless.begin(), valueless.end()),
+      std::bad_variant_access);
+}
+
+TEST_CASE("visit, visit_spans") {
+  struct null_t {};
+  using v_t = std::variant<std::int64_t, double, null_t>;
+  std::vector<v_t> xs{1, 2, null_t{}, 0.5, 1.5};
+  for (int i = 0; i < 100; ++i) {
+    xs.push_back(1.0);
+  }
+  xs.push_back(std::int64_t{3});
+
+  double sum = 0;
+  std::vector<std::string> calls;
+  auto op = overload{
+      [&](span<const double> values) {
+        calls.push_back("d" + std::to_string(values.size()));
+        for (double x : values) {
+          sum += x;
+        }
+      },
+      [&](span<const std::int64_t> values) {
+        calls.push_back("i" + std::to_string(values.size()));
+        for (std::int64_t x : values) {
+          sum += x;
+        }
+      },
+      [&](null_t) { calls.push_back("null"); }};
+  visit_spans(op, xs.begin(), xs.end());
+  REQUIRE(sum == 108);
+  REQUIRE(calls == std::vector<std::string>{"i2", "null", "d64", "d38", "i1"});
+
+  // No span overloads: one call per element.
+  calls.clear();
+  visit_spans(
+      overload{[&](std::int64_t x) { calls.push_back(std::to_string(x)); },
+               [&](double) { calls.push_back("d"); },
+               [&](null_t) { calls.push_back("null"); }},
+      xs.begin(), xs.begin() + 5);
+  REQUIRE(calls == std::vector<std::string>{"1", "2", "null", "d", "d"});
+
+  // Generic overloads are never called with spans.
+  sum = 0;
+  visit_spans(overload{[&](null_t) {}, [&](auto x) { sum += x; }},
+              xs.begin(), xs.end());
+  REQUIRE(sum == 108);
+  sum = 0;
+  visit_spans(
+      overload{[&](span<const double> values) {
+                 for (double x : values) {
+                   sum += 2 * x;
+                 }
+               },
+               [&](null_t) {}, [&](auto x) { sum += x; }},
+      xs.begin(), xs.end());
+  REQUIRE(sum == 210);
+}
+
+TEST_CASE("visit, triangular_index_math") {
+  using math = triangular_index_math<4>;
+  static_assert(math::size_linear == 10);
+
+  size_t expected = 0;
+  for (size_t i = 0; i < 4; ++i) {
+    for (size_t j = i; j < 4; ++j) {
+      REQUIRE(math::as_linear({i, j}) == expected);
+      REQUIRE(math::as_multi_a(expected) == std::array<size_t, 2>{i, j});
+      ++expected;
+    }
+  }
+
+  is_same_test(math::as_multi_s<9>(), std::index_sequence<3, 3>{});
+  is_same_test(math::as_multi_s<4>(), std::index_sequence<1, 1>{});
+}
+
+TEST_CASE("visit, symmetric") {
+  struct circle {};
+  struct square {};
+  struct line {};
+  using shape = std::variant<circle, square, line>;
+
+  // Only defined for the upper triangle.
+  auto collide = overload{
+      [](circle, circle) { return 0; }, [](circle, square) { return 1; },
+      [](circle, line) { return 2; },   [](square, square) { return 3; },
+      [](square, line) { return 4; },   [](line, line) { return 5; }};
+
+  using FwdV = const shape&;
+  static_assert(symmetric_vtable<int, decltype(collide)&, FwdV>.size() == 10);
+  is_same_test(symmetric_return_type<decltype(collide)&, FwdV>{}, int{});
+
+  shape shapes[] = {circle{}, square{}, line{}};
+  int expected[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+  for (size_t i = 0; i < 3; ++i) {
+    for (size_t j = 0; j < 3; ++j) {
+      REQUIRE(visit_symmetric(collide, shapes[i], shapes[j]) ==
+              expected[i][j]);
+    }
+  }
+
+  static_assert(visit_symmetric([](auto x, auto y) { return x + y; },
+                                std::variant<int, char>{'a'},
+                                std::variant<int, char>{1}) == 'a' + 1);
+
+  // Mixed constness goes through the const& table.
+  REQUIRE(visit_symmetric(collide, shapes[2], std::as_const(shapes[1])) == 4);
+  static_assert(std::is_same_v<symmetric_forward_t<shape&, const shape&>,
+                               const shape&>);
+  static_assert(
+      std::is_same_v<symmetric_forward_t<shape&&, shape&&>, shape&&>);
+
+  // Not a candidate for two different variants.
+  auto symmetric_callable = [](auto&& a, auto&& b)
+      -> decltype(visit_symmetric(collide, a, b), true) { return true; };
+  static_assert(std::is_invocable_v<decltype(symmetric_callable), shape&,
+                                    const shape&>);
+  static_assert(!std::is_invocable_v<decltype(symmetric_callable), shape&,
+                                     std::variant<int>&>);
+}
+
 TEST_CASE("should_enable_visit_r") {
   struct A{};
   struct B{};
@@ -231,6 +825,28 @@ TEST_CASE("visit_return_type") {
   }
 }
 
+TEST_CASE("visit, visit_traits") {
+  struct A {};
+  using v = std::variant<int, char, double>;
+  auto plus = [](auto x, auto y) -> decltype(x + y) { return x + y; };
+
+  using traits = visit_traits<decltype(plus)&, const v&, v&&>;
+  is_same_test(traits::result{}, type_t<double>{});
+  static_assert(traits::invocable_r<int>);
+  static_assert(traits::invocable_r<void>);
+  static_assert(!traits::invocable_r<A>);
+  static_assert(!traits::nothrow_r<int>);
+
+  using not_invocable =
+      visit_traits<decltype(plus)&, const v&, std::variant<A, int>&>;
+  is_same_test(not_invocable::result{}, null_t{});
+  static_assert(!not_invocable::invocable_r<void>);
+
+  using not_variant = visit_traits<decltype(plus)&, const v&, int>;
+  is_same_test(not_variant::result{}, null_t{});
+  static_assert(!not_variant::invocable_r<void>);
+}
+
 TEST_CASE("visit, complete") {
   {
     auto op = [](auto&& ...) { return 3; };
@@ -257,4 +873,128 @@ TEST_CASE("visit, complete") {
   }
 }
 
+#ifdef TOOLS_VISIT_INSTRUMENTATION
+
+TEST_CASE("visit, instrumentation") {
+  using v_t = std::variant<int, char>;
+  auto op = [](auto) { return 0; };
+
+  v_t x{'a'};
+  tools::visit(op, x);
+  std::thread([&] {
+    tools::visit(op, x);
+    x = 1;
+    tools::visit(op, x);
+  }).join();
+
+  using site = instrumentation::site_of<int, decltype(op)&, v_t&>;
+  REQUIRE(site::get().size == 3);
+  REQUIRE(instrumentation::count<int, decltype(op)&, v_t&>(0) == 0);
+  REQUIRE(instrumentation::count<int, decltype(op)&, v_t&>(1) == 1);
+  REQUIRE(instrumentation::count<int, decltype(op)&, v_t&>(2) == 2);
+
+  auto binary_op = [](auto, auto) {};
+  tools::visit(binary_op, x, std::as_const(x));
+
+  std::ostringstream csv;
+  instrumentation::write_csv(csv);
+  REQUIRE(csv.str().find(",1,\"int\",1\n") != std::string::npos);
+  REQUIRE(csv.str().find(",2,\"char\",2\n") != std::string::npos);
+  REQUIRE(csv.str().find(",\"int int\",1\n") != std::string::npos);
+
+  std::ostringstream json;
+  instrumentation::write_json(json);
+  REQUIRE(json.str().find("\"alternatives\": \"char\", \"count\": 2") !=
+          std::string::npos);
+}
+
+TEST_CASE("visit, instrumentation escaping") {
+  std::ostringstream csv;
+  instrumentation::write_csv_field(csv, "f<\"a,b\">");
+  REQUIRE(csv.str() == "\"f<\"\"a,b\"\">\"");
+
+  std::ostringstream json;
+  instrumentation::write_json_string(json, "f<\"a\\b\">\n");
+  REQUIRE(json.str() == "\"f<\\\"a\\\\b\\\">\\u000a\"");
+}
+
+#endif  // TOOLS_VISIT_INSTRUMENTATION
+
+}  // namespace tools
+
+namespace extern_table_test {
+
+struct op {
+  int operator()(int) const { return 1; }
+  int operator()(char) const { return 2; }
+};
+
+using v = std::variant<int, char>;
+
+}  // namespace extern_table_test
+
+// Normally the two are in a header and in a .cc, both at global scope.
+TOOLS_VISIT_EXTERN_TABLE(int,
+                         const extern_table_test::op&,
+                         const extern_table_test::v&)
+TOOLS_VISIT_INSTANTIATE_TABLE(int,
+                              const extern_table_test::op&,
+                              const extern_table_test::v&)
+
+namespace tools {
+
+TEST_CASE("visit, extern table") {
+  using extern_table_test::op;
+  using extern_table_test::v;
+
+  static_assert(extern_visit_table<int, const op&, const v&>::value);
+  static_assert(!extern_visit_table<int, const op&, v&>::value);
+
+  const op visitor;
+  v x{'a'};
+  REQUIRE(visit_with_r<int>(visitor, std::as_const(x)) == 2);
+  REQUIRE(visit_with_r<int>(visitor, x) == 2);
+  x = 1;
+  REQUIRE(visit_with_r<int>(visitor, std::as_const(x)) == 1);
+}
+
+enum class simd_width { sse, avx2, avx512, count };
+enum class unroll { x1, x2, x4 };
+
+template <>
+struct enum_size<unroll> : std::integral_constant<size_t, 3> {};
+
+template <size_t... idxs>
+constexpr auto seq_to_array(std::index_sequence<idxs...>) {
+  return std::array<size_t, sizeof...(idxs)>{idxs...};
+}
+
+template <simd_width width, bool aligned>
+constexpr int kernel() {
+  return static_cast<int>(width) * 10 + aligned;
+}
+
+TEST_CASE("visit, dispatch_index") {
+  auto as_array = [](auto seq) { return seq_to_array(seq); };
+  REQUIRE(dispatch_index<3, 4>(as_array, 2, 1) ==
+          std::array<size_t, 2>{2, 1});
+  for (size_t i = 0; i < 5; ++i) {
+    REQUIRE(dispatch_index<5>(as_array, i) == std::array<size_t, 1>{i});
+  }
+
+  static_assert(index_count<bool>::value == 2);
+  static_assert(index_count<simd_width>::value == 3);
+  static_assert(index_count<unroll>::value == 3);
+  static_assert(!has_index_count_v<int>);
+
+  auto run_kernel = [](auto width, auto aligned) {
+    return kernel<width(), aligned()>();
+  };
+  static_assert(dispatch_index(run_kernel, simd_width::avx2, true) == 11);
+  REQUIRE(dispatch_index(run_kernel, simd_width::avx512, false) == 20);
+
+  auto unrolled = [](auto u) { return 1 << static_cast<int>(u()); };
+  REQUIRE(dispatch_index(unrolled, unroll::x4) == 4);
+}
+
 }  // namespace tools